@@ -0,0 +1,132 @@
+#ifndef AGG_BUFFER_H
+#define AGG_BUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define u64 uint64_t
+
+// Slots of the pre-aggregation buffer, 16 bytes each: 512 slots are 8KB and
+// stay in L1 next to the hot part of the sketch.
+#ifndef AGG_SLOTS
+#define AGG_SLOTS 512
+#endif
+
+// Evicted (item, weight) pairs handed to the sketch per flush.
+#ifndef AGG_FLUSH
+#define AGG_FLUSH 64
+#endif
+
+// Direct mapped pre-aggregation buffer. A repeated key only bumps its slot's
+// count, a different key landing on an occupied slot evicts the old pair to
+// a pending list that is handed to the sketch in batches of AGG_FLUSH as
+// weighted updates. Under a skewed stream the hot keys live in the buffer
+// and most items never reach the sketch one by one.
+//
+// Slots and the pending list live in one arena sized at construction,
+// nothing is allocated afterwards.
+class AggBuffer {
+private:
+    struct Entry {
+        u64 item;
+        u64 count; // 0 = empty
+    };
+
+    Entry* slots;
+    u64* pendingItems;
+    u64* pendingWeights;
+    size_t pending;
+    size_t used; // occupied slots
+    size_t arenaBytes;
+    u64 mask;
+    int shift;
+
+    size_t home(u64 item) const {
+        return (size_t)((item * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+
+public:
+    // capacity is rounded up to a power of two, at least 8.
+    AggBuffer(size_t capacity) : pending(0), used(0) {
+        u64 cap = 8;
+        while (cap < capacity) cap <<= 1;
+        mask = cap - 1;
+        shift = 64 - __builtin_ctzll(cap);
+        size_t slotBytes = cap * sizeof(Entry);
+        size_t pendingBytes = AGG_FLUSH * sizeof(u64);
+        arenaBytes = (slotBytes + 2 * pendingBytes + 63) & ~(size_t)63;
+        char* arena = (char*)aligned_alloc(64, arenaBytes);
+        if (!arena) {
+            fprintf(stderr, "Unable to allocate memory for sketch\n");
+            exit(1);
+        }
+        slots = (Entry*)arena;
+        pendingItems = (u64*)(arena + slotBytes);
+        pendingWeights = (u64*)(arena + slotBytes + pendingBytes);
+        memset(slots, 0, slotBytes);
+    }
+
+    ~AggBuffer() {
+        free(slots);
+    }
+
+    AggBuffer(const AggBuffer&) = delete;
+    AggBuffer& operator=(const AggBuffer&) = delete;
+
+    // Coalesces weight occurrences of item. Returns true when the pending
+    // list is full and must be drained before the next add.
+    bool add(u64 item, u64 weight) {
+        Entry& e = slots[home(item)];
+        if (e.item == item && e.count != 0) {
+            e.count += weight;
+            return false;
+        }
+        if (weight == 0) return false;
+        if (e.count != 0) {
+            pendingItems[pending] = e.item;
+            pendingWeights[pending] = e.count;
+            pending++;
+        } else {
+            used++;
+        }
+        e.item = item;
+        e.count = weight;
+        return pending == AGG_FLUSH;
+    }
+
+    // Hands the pending pairs to fn(items, weights, n) and empties the list.
+    template <typename F>
+    void drain(F fn) {
+        if (pending == 0) return;
+        fn(pendingItems, pendingWeights, pending);
+        pending = 0;
+    }
+
+    // Drains every buffered pair, pending and resident, leaving the buffer
+    // empty. Cheap when there is nothing buffered.
+    template <typename F>
+    void flush(F fn) {
+        drain(fn);
+        for (u64 i = 0; used > 0 && i <= mask; ++i) {
+            if (slots[i].count == 0) continue;
+            pendingItems[pending] = slots[i].item;
+            pendingWeights[pending] = slots[i].count;
+            pending++;
+            slots[i].count = 0;
+            used--;
+            if (pending == AGG_FLUSH) drain(fn);
+        }
+        drain(fn);
+    }
+
+    bool empty() const { return pending == 0 && used == 0; }
+
+    size_t size() const {
+        return sizeof(*this) + arenaBytes;
+    }
+};
+
+#endif // AGG_BUFFER_H
@@ -0,0 +1,439 @@
+// Benchmark harness: sweeps sketch type, N, phi, width, depth, threads, Zipf
+// exponent, counter table allocation and Add dispatch in one process and
+// writes one record per run as JSON or CSV (see generate_plot.py run_bench).
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "zipf.h"
+#include "sketch.h"
+#include "static_sketch.h"
+#include "concurrent_sketch.h"
+#include "table_alloc.h"
+
+using namespace std::chrono;
+
+#define UNIVERSE 1ULL << 30
+#define COUNT_ERROR_THRESHOLD 0.01 // same scoring as test.cc
+// Every BENCH_SAMPLE_EVERY-th update of the latency pass is timed on its own.
+#ifndef BENCH_SAMPLE_EVERY
+#define BENCH_SAMPLE_EVERY 64
+#endif
+// Point queries timed per run.
+#ifndef BENCH_QUERIES
+#define BENCH_QUERIES 4096
+#endif
+
+// Estimates land here so the query loops are not optimized away.
+static volatile u64 bench_sink;
+
+struct BenchRun {
+  std::string sketch;
+  u64 n;
+  double phi;
+  u64 width, depth; // 0: compiled default, always 0 for MG/SS
+  size_t threads;
+  double exp;
+  std::string alloc; // table_pages_name of the counter tables
+  std::string dispatch; // "runtime": Sketch, "static": StaticSketch<Backend>
+  double alloc_us;   // constructing the sketch, zeroing its tables included
+  u64 huge_bytes;    // huge page backed bytes the sketch added to the process
+  double update_ns;  // wall time / N of the untimed pass
+  double p50_ns, p99_ns, p999_ns; // sampled single update latency
+  double query_ns;   // mean Estimate, ConcurrentSketch merges per query
+  double hh_us;      // HeavyHitters(phi)
+  u64 size;
+  u64 real_k;
+  double precision, recall; // percent
+};
+
+static std::vector<std::string> split(const char* list) {
+  std::vector<std::string> out;
+  std::string cur;
+  for (const char* p = list;; ++p) {
+    if (*p == ',' || *p == '\0') {
+      if (!cur.empty()) out.push_back(cur);
+      cur.clear();
+      if (*p == '\0') break;
+    } else {
+      cur += *p;
+    }
+  }
+  return out;
+}
+
+static std::vector<u64> split_u64(const char* list) {
+  std::vector<u64> out;
+  for (const std::string& s : split(list)) out.push_back(strtoull(s.c_str(), NULL, 10));
+  return out;
+}
+
+static std::vector<double> split_double(const char* list) {
+  std::vector<double> out;
+  for (const std::string& s : split(list)) out.push_back(atof(s.c_str()));
+  return out;
+}
+
+static bool parse_type(const std::string& name, SketchType* type) {
+  if (name == "cms") *type = SketchType::CMS;
+  else if (name == "cs") *type = SketchType::CS;
+  else if (name == "mg") *type = SketchType::MG;
+  else if (name == "ss") *type = SketchType::SS;
+  else if (name == "dcms") *type = SketchType::DYADIC;
+  else return false;
+  return true;
+}
+
+static inline double ns_between(steady_clock::time_point a, steady_clock::time_point b) {
+  return duration<double, std::nano>(b - a).count();
+}
+
+// Cost of reading the clock twice, taken off every sampled latency.
+static double clock_overhead_ns() {
+  double best = 1e9;
+  for (int i = 0; i < 1000; ++i) {
+    steady_clock::time_point a = steady_clock::now();
+    steady_clock::time_point b = steady_clock::now();
+    best = std::min(best, ns_between(a, b));
+  }
+  return best;
+}
+
+static double percentile(std::vector<double>& sorted, double q) {
+  if (sorted.empty()) return 0;
+  size_t at = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+  return sorted[at];
+}
+
+static void score(const std::multimap<u64, u64, std::greater<u64>>& found,
+                  const std::unordered_map<u64, u64>& topK, BenchRun* run) {
+  double tp = 0;
+  for (const auto& [element, est_count] : found) {
+    auto it = topK.find(element);
+    if (it == topK.end()) continue;
+    double error = std::abs((double)est_count - (double)it->second) / it->second;
+    if (error <= COUNT_ERROR_THRESHOLD) tp++;
+  }
+  double fp = found.size() - tp, fn = topK.size() - tp;
+  run->real_k = topK.size();
+  run->precision = tp + fp > 0 ? tp / (tp + fp) * 100 : 0;
+  run->recall = tp + fn > 0 ? tp / (tp + fn) * 100 : 0;
+}
+
+// Sampled latencies of a pass over items[begin, end) through add(item).
+template <typename AddFn>
+static void sample_updates(const u64* items, u64 begin, u64 end, double overhead,
+                           std::vector<double>* out, AddFn add) {
+  for (u64 i = begin; i < end; ++i) {
+    if (i % BENCH_SAMPLE_EVERY) {
+      add(items[i]);
+      continue;
+    }
+    steady_clock::time_point a = steady_clock::now();
+    add(items[i]);
+    steady_clock::time_point b = steady_clock::now();
+    out->push_back(std::max(0.0, ns_between(a, b) - overhead));
+  }
+}
+
+// Times make(), then an untimed update pass over it and a sampled latency
+// pass over a second one. Returns the first for the queries.
+template <typename MakeFn>
+static auto update_passes(BenchRun* run, const u64* items, double overhead,
+                          std::vector<double>* lat, MakeFn make) {
+  u64 N = run->n;
+  u64 huge = table_huge_bytes();
+  steady_clock::time_point t0 = steady_clock::now();
+  auto s = make();
+  steady_clock::time_point t1 = steady_clock::now();
+  run->alloc_us = ns_between(t0, t1) / 1e3;
+  u64 after = table_huge_bytes();
+  run->huge_bytes = after > huge ? after - huge : 0;
+  for (u64 i = 0; i < N; ++i) s.Add(items[i]);
+  steady_clock::time_point t2 = steady_clock::now();
+  run->update_ns = ns_between(t1, t2) / N;
+
+  // Latency pass on a fresh sketch, the clock reads would skew the one above.
+  auto timed = make();
+  lat->reserve(N / BENCH_SAMPLE_EVERY + 1);
+  sample_updates(items, 0, N, overhead, lat, [&timed](u64 item) { timed.Add(item); });
+  return s;
+}
+
+static void run_single(BenchRun* run, SketchType type, const SketchConfig& config,
+                       const u64* items, const std::unordered_map<u64, u64>& topK,
+                       double overhead) {
+  u64 N = run->n;
+  std::vector<double> lat;
+  // A static run hands its backend to a Sketch for the queries, which are
+  // the same code either way.
+  Sketch s = run->dispatch == "static" ?
+      sketch_visit(type, [&](auto b) {
+        return update_passes(run, items, overhead, &lat, [&] {
+          return StaticSketch<decltype(b)>(N, run->phi, config);
+        }).Release();
+      }) :
+      update_passes(run, items, overhead, &lat, [&] { return Sketch(N, run->phi, type, config); });
+  std::sort(lat.begin(), lat.end());
+  run->p50_ns = percentile(lat, 0.50);
+  run->p99_ns = percentile(lat, 0.99);
+  run->p999_ns = percentile(lat, 0.999);
+
+  u64 queries = std::min<u64>(N, BENCH_QUERIES), sink = 0;
+  steady_clock::time_point t1 = steady_clock::now();
+  for (u64 q = 0; q < queries; ++q) sink += s.Estimate(items[q * (N / queries)]);
+  steady_clock::time_point t2 = steady_clock::now();
+  run->query_ns = queries ? ns_between(t1, t2) / queries : 0;
+  bench_sink = sink;
+
+  t1 = steady_clock::now();
+  std::multimap<u64, u64, std::greater<u64>> found = s.HeavyHitters(run->phi);
+  t2 = steady_clock::now();
+  run->hh_us = ns_between(t1, t2) / 1e3;
+  run->size = s.Size();
+  score(found, topK, run);
+}
+
+// Stream [t*chunk, (t+1)*chunk) per thread through a ConcurrentSketch.
+static double run_threads(ConcurrentSketch& cs, const u64* items, u64 N, size_t threads,
+                          double overhead, std::vector<std::vector<double>>* lat) {
+  std::vector<std::thread> workers;
+  u64 chunk = (N + threads - 1) / threads;
+  steady_clock::time_point t1 = steady_clock::now();
+  for (size_t t = 0; t < threads; ++t) {
+    u64 begin = std::min<u64>(N, t * chunk);
+    u64 end = std::min<u64>(N, begin + chunk);
+    workers.emplace_back([&cs, items, begin, end, t, overhead, lat] {
+      if (lat) {
+        sample_updates(items, begin, end, overhead, &(*lat)[t],
+                       [&cs, t](u64 item) { cs.Add(t, item); });
+      } else {
+        for (u64 i = begin; i < end; ++i) cs.Add(t, items[i]);
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+  return ns_between(t1, steady_clock::now());
+}
+
+static void run_concurrent(BenchRun* run, SketchType type, const SketchConfig& config,
+                           const u64* items, const std::unordered_map<u64, u64>& topK,
+                           double overhead) {
+  u64 N = run->n;
+  u64 huge = table_huge_bytes();
+  steady_clock::time_point t0 = steady_clock::now();
+  ConcurrentSketch cs(N, run->phi, type, run->threads, config);
+  run->alloc_us = ns_between(t0, steady_clock::now()) / 1e3;
+  u64 after = table_huge_bytes();
+  run->huge_bytes = after > huge ? after - huge : 0;
+  run->update_ns = run_threads(cs, items, N, run->threads, overhead, NULL) / N;
+
+  ConcurrentSketch timed(N, run->phi, type, run->threads, config);
+  std::vector<std::vector<double>> per_thread(run->threads);
+  run_threads(timed, items, N, run->threads, overhead, &per_thread);
+  std::vector<double> lat;
+  for (const auto& v : per_thread) lat.insert(lat.end(), v.begin(), v.end());
+  std::sort(lat.begin(), lat.end());
+  run->p50_ns = percentile(lat, 0.50);
+  run->p99_ns = percentile(lat, 0.99);
+  run->p999_ns = percentile(lat, 0.999);
+
+  // Every on-demand query merges the replicas, so fewer of them.
+  u64 queries = std::min<u64>(N, BENCH_QUERIES / 16), sink = 0;
+  steady_clock::time_point t1 = steady_clock::now();
+  for (u64 q = 0; q < queries; ++q) sink += cs.Estimate(items[q * (N / queries)]);
+  steady_clock::time_point t2 = steady_clock::now();
+  run->query_ns = queries ? ns_between(t1, t2) / queries : 0;
+  bench_sink = sink;
+
+  t1 = steady_clock::now();
+  std::multimap<u64, u64, std::greater<u64>> found = cs.HeavyHitters(run->phi);
+  t2 = steady_clock::now();
+  run->hh_us = ns_between(t1, t2) / 1e3;
+  run->size = cs.Size();
+  score(found, topK, run);
+}
+
+static void write_json(FILE* out, const std::vector<BenchRun>& runs) {
+  fprintf(out, "[\n");
+  for (size_t i = 0; i < runs.size(); ++i) {
+    const BenchRun& r = runs[i];
+    fprintf(out, "  {\"sketch\": \"%s\", \"n\": %lu, \"phi\": %g, \"width\": %lu, \"depth\": %lu, "
+            "\"threads\": %zu, \"exp\": %g, \"alloc\": \"%s\", \"dispatch\": \"%s\", "
+            "\"alloc_us\": %.1f, "
+            "\"huge_bytes\": %lu, \"update_ns\": %.3f, \"p50_ns\": %.1f, "
+            "\"p99_ns\": %.1f, \"p999_ns\": %.1f, \"query_ns\": %.1f, \"hh_us\": %.3f, "
+            "\"sketch_size\": %lu, \"real_k\": %lu, \"precision\": %.2f, \"recall\": %.2f}%s\n",
+            r.sketch.c_str(), r.n, r.phi, r.width, r.depth, r.threads, r.exp, r.alloc.c_str(),
+            r.dispatch.c_str(), r.alloc_us, r.huge_bytes, r.update_ns, r.p50_ns, r.p99_ns,
+            r.p999_ns, r.query_ns, r.hh_us, r.size, r.real_k, r.precision, r.recall, i + 1 < runs.size() ? "," : "");
+  }
+  fprintf(out, "]\n");
+}
+
+static void write_csv(FILE* out, const std::vector<BenchRun>& runs) {
+  fprintf(out, "sketch,n,phi,width,depth,threads,exp,alloc,dispatch,alloc_us,huge_bytes,update_ns,"
+          "p50_ns,p99_ns,p999_ns,query_ns,hh_us,sketch_size,real_k,precision,recall\n");
+  for (const BenchRun& r : runs)
+    fprintf(out, "%s,%lu,%g,%lu,%lu,%zu,%g,%s,%s,%.1f,%lu,%.3f,%.1f,%.1f,%.1f,%.1f,%.3f,%lu,%lu,"
+            "%.2f,%.2f\n",
+            r.sketch.c_str(), r.n, r.phi, r.width, r.depth, r.threads, r.exp, r.alloc.c_str(),
+            r.dispatch.c_str(), r.alloc_us, r.huge_bytes, r.update_ns, r.p50_ns, r.p99_ns,
+            r.p999_ns, r.query_ns, r.hh_us, r.size, r.real_k, r.precision, r.recall);
+}
+
+int main(int argc, char** argv)
+{
+  std::vector<std::string> sketches = {"cms", "cs", "mg", "ss"};
+  std::vector<u64> ns = {10000000}, widths = {0}, depths = {0}, threads = {1};
+  std::vector<double> phis = {0.001}, exps = {1.5};
+  std::vector<std::string> allocs = {"default"};
+  std::vector<std::string> dispatches = {"runtime"};
+  int node = TABLE_ANY_NODE;
+  u64 stream_seed = time(NULL);
+  bool csv = false;
+  const char* out_path = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "--sketch=", 9) == 0) {
+      sketches = split(argv[i] + 9);
+    } else if (strncmp(argv[i], "--n=", 4) == 0) {
+      ns = split_u64(argv[i] + 4);
+    } else if (strncmp(argv[i], "--phi=", 6) == 0) {
+      phis = split_double(argv[i] + 6);
+    } else if (strncmp(argv[i], "--width=", 8) == 0) {
+      widths = split_u64(argv[i] + 8);
+    } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+      depths = split_u64(argv[i] + 8);
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = split_u64(argv[i] + 10);
+    } else if (strncmp(argv[i], "--exp=", 6) == 0) {
+      exps = split_double(argv[i] + 6);
+    } else if (strncmp(argv[i], "--alloc=", 8) == 0) {
+      allocs = split(argv[i] + 8);
+    } else if (strncmp(argv[i], "--dispatch=", 11) == 0) {
+      dispatches = split(argv[i] + 11);
+    } else if (strcmp(argv[i], "--numa=local") == 0) {
+      node = TABLE_LOCAL_NODE;
+    } else if (strncmp(argv[i], "--numa=", 7) == 0) {
+      node = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--stream-seed=", 14) == 0) {
+      stream_seed = strtoull(argv[i] + 14, NULL, 10);
+    } else if (strcmp(argv[i], "--format=json") == 0) {
+      csv = false;
+    } else if (strcmp(argv[i], "--format=csv") == 0) {
+      csv = true;
+    } else if (strncmp(argv[i], "--out=", 6) == 0) {
+      out_path = argv[i] + 6;
+    } else {
+      std::cerr << "Unknown option " << argv[i] << "\n";
+      exit(1);
+    }
+  }
+  for (const std::string& name : sketches) {
+    SketchType type;
+    if (!parse_type(name, &type)) {
+      std::cerr << "Unknown sketch " << name << "\n";
+      exit(1);
+    }
+  }
+  for (const std::string& name : allocs) {
+    TablePages pages;
+    if (!table_parse_pages(name.c_str(), &pages)) {
+      std::cerr << "Unknown allocation " << name << "\n";
+      exit(1);
+    }
+  }
+  for (const std::string& name : dispatches) {
+    if (name != "runtime" && name != "static") {
+      std::cerr << "Unknown dispatch " << name << "\n";
+      exit(1);
+    }
+  }
+  std::string path = out_path ? out_path : (csv ? "bench.csv" : "bench.json");
+  double overhead = clock_overhead_ns();
+  std::cout << "Stream seed: " << stream_seed << "\tClock overhead: " << overhead << " ns\n";
+
+  std::vector<BenchRun> runs;
+  u64 max_n = *std::max_element(ns.begin(), ns.end());
+  uint64_t* numbers = (uint64_t*)malloc(max_n * sizeof(uint64_t));
+  if (!numbers) {
+    std::cerr << "Malloc numbers failed.\n";
+    exit(1);
+  }
+  for (double exp : exps) {
+    for (u64 N : ns) {
+      // One stream and one exact count per (exponent, N), shared by all runs.
+      generate_random_keys_seeded(numbers, UNIVERSE, N, exp, stream_seed, 0);
+      std::unordered_map<u64, u64> counts(N);
+      for (u64 i = 0; i < N; ++i) counts[numbers[i]]++;
+      u64 key_bits = dcms_key_bits(numbers, N);
+      for (const std::string& name : sketches) {
+        SketchType type;
+        parse_type(name, &type);
+        bool linear = type == SketchType::CMS || type == SketchType::CS;
+        bool sized = linear || type == SketchType::DYADIC;
+        // width/depth only mean something for CMS/CS/DYADIC, threads for CMS/CS.
+        std::vector<u64> ws = sized ? widths : std::vector<u64>{0};
+        std::vector<u64> ds = sized ? depths : std::vector<u64>{0};
+        for (double phi : phis) {
+          std::unordered_map<u64, u64> topK;
+          for (const auto& pair : counts)
+            if (pair.second >= phi * N) topK.insert(pair);
+          for (u64 width : ws) {
+            for (u64 depth : ds) {
+              for (u64 t : threads) {
+                if (t > 1 && !linear) continue;
+                for (const std::string& alloc : allocs) {
+                  for (const std::string& dispatch : dispatches) {
+                    // ConcurrentSketch replicas are runtime dispatched only.
+                    if (t > 1 && dispatch == "static") continue;
+                    BenchRun run = {name, N, phi, width, depth, t, exp, alloc, dispatch};
+                    SketchConfig config;
+                    config.width = width;
+                    config.depth = depth;
+                    if (type == SketchType::DYADIC) config.universe_bits = key_bits;
+                    table_parse_pages(alloc.c_str(), &config.alloc.pages);
+                    config.alloc.node = node;
+                    if (t > 1)
+                      run_concurrent(&run, type, config, numbers, topK, overhead);
+                    else
+                      run_single(&run, type, config, numbers, topK, overhead);
+                    printf("%s N=%lu phi=%g %lux%lu threads=%zu exp=%g alloc=%s dispatch=%s: "
+                           "%0.2f ns/op p50/p99/p999 %0.0f/%0.0f/%0.0f ns recall %0.2f\n",
+                           name.c_str(), N, phi, depth, width, t, exp, alloc.c_str(),
+                           dispatch.c_str(), run.update_ns, run.p50_ns, run.p99_ns, run.p999_ns,
+                           run.recall);
+                    runs.push_back(run);
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  free(numbers);
+
+  FILE* out = fopen(path.c_str(), "w");
+  if (!out) {
+    std::cerr << "Unable to write " << path << "\n";
+    exit(1);
+  }
+  if (csv) write_csv(out, runs);
+  else write_json(out, runs);
+  fclose(out);
+  std::cout << "Wrote " << runs.size() << " runs to " << path << "\n";
+  return 0;
+}
@@ -0,0 +1,199 @@
+#include "concurrent_sketch.h"
+#include "count_min_sketch.h"
+#include "count_sketch.h"
+#include "min_heap.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Items an owner thread ingests per lock acquisition in AddBatch, bounds how
+// long a merge can wait on a replica.
+#ifndef CONCURRENT_CHUNK
+#define CONCURRENT_CHUNK 4096
+#endif
+
+ConcurrentSketch::ConcurrentSketch(u64 N, double phi, SketchType type, size_t num_threads,
+                                   const SketchConfig& config, u64 epoch_ms)
+    : merged_seen(0), type(type), epoch_ms(epoch_ms), stopping(false) {
+  if (num_threads == 0) {
+    fprintf(stderr, "ConcurrentSketch needs at least one thread\n");
+    exit(1);
+  }
+  if (type != SketchType::CMS && type != SketchType::CS) {
+    fprintf(stderr, "ConcurrentSketch only supports CMS and CS\n");
+    exit(1);
+  }
+  merged = make_backend(type, N, phi, config);
+  for (size_t t = 0; t < num_threads; ++t) {
+    Replica* r = new Replica;
+    r->seen = 0;
+    switch(type) {
+      case SketchType::CMS: r->backend = cms_init_like(static_cast<CountMinSketch*>(merged)); break;
+      case SketchType::CS: r->backend = cs_init_like(static_cast<CountSketch*>(merged)); break;
+      default: break;
+    }
+    replicas.push_back(r);
+  }
+  if (epoch_ms > 0) {
+    epoch_thread = std::thread(&ConcurrentSketch::EpochLoop, this);
+  }
+}
+
+void ConcurrentSketch::Add(size_t thread, u64 item, u64 weight) {
+  Replica* r = replicas[thread];
+  std::lock_guard<std::mutex> guard(r->lock);
+  r->seen += weight;
+  switch(type) {
+    case SketchType::CMS: cms_add(static_cast<CountMinSketch*>(r->backend), item, weight); break;
+    case SketchType::CS:  cs_add(static_cast<CountSketch*>(r->backend), item, weight); break;
+    default: break;
+  }
+}
+
+void ConcurrentSketch::AddBatch(size_t thread, const u64* items, size_t n) {
+  Replica* r = replicas[thread];
+  for (size_t start = 0; start < n; start += CONCURRENT_CHUNK) {
+    size_t len = n - start < CONCURRENT_CHUNK ? n - start : CONCURRENT_CHUNK;
+    std::lock_guard<std::mutex> guard(r->lock);
+    r->seen += len;
+    switch(type) {
+      case SketchType::CMS:
+        cms_add_batch(static_cast<CountMinSketch*>(r->backend), items + start, len);
+        break;
+      case SketchType::CS:
+        for (size_t i = start; i < start + len; ++i)
+          cs_add(static_cast<CountSketch*>(r->backend), items[i]);
+        break;
+      default: break;
+    }
+  }
+}
+
+void ConcurrentSketch::Merge() {
+  std::lock_guard<std::mutex> guard(merge_lock);
+  std::vector<u64> candidates;
+  merged_seen = 0;
+  switch(type) {
+    case SketchType::CMS: {
+      CountMinSketch* dst = static_cast<CountMinSketch*>(merged);
+      cms_clear(dst);
+      for (Replica* r : replicas) {
+        std::lock_guard<std::mutex> rguard(r->lock);
+        CountMinSketch* src = static_cast<CountMinSketch*>(r->backend);
+        merged_seen += r->seen;
+        cms_merge_slots(dst, src);
+        for (const HeapElement& e : src->heap->getTopK()) candidates.push_back(e.item);
+      }
+      for (u64 item : candidates) dst->heap->insertOrUpdate(item, cms_estimate(dst, item));
+      break;
+    }
+    case SketchType::CS: {
+      CountSketch* dst = static_cast<CountSketch*>(merged);
+      cs_clear(dst);
+      for (Replica* r : replicas) {
+        std::lock_guard<std::mutex> rguard(r->lock);
+        CountSketch* src = static_cast<CountSketch*>(r->backend);
+        merged_seen += r->seen;
+        cs_merge_slots(dst, src);
+        for (const HeapElement& e : src->heap->getTopK()) candidates.push_back(e.item);
+      }
+      for (u64 item : candidates) dst->heap->insertOrUpdate(item, cs_estimate(dst, item));
+      break;
+    }
+    default: break;
+  }
+}
+
+void ConcurrentSketch::EpochLoop() {
+  std::unique_lock<std::mutex> lock(epoch_lock);
+  while (!stopping) {
+    epoch_cv.wait_for(lock, std::chrono::milliseconds(epoch_ms));
+    if (stopping) break;
+    lock.unlock();
+    Merge();
+    lock.lock();
+  }
+}
+
+u64 ConcurrentSketch::Estimate(u64 item) {
+  if (epoch_ms == 0) Merge();
+  std::lock_guard<std::mutex> guard(merge_lock);
+  switch(type) {
+    case SketchType::CMS: return cms_estimate(static_cast<CountMinSketch*>(merged), item);
+    case SketchType::CS:  return cs_estimate(static_cast<CountSketch*>(merged), item);
+    default: break;
+  }
+  return 0;
+}
+
+// Quiet cms_size/cs_size, for a backend whose lock the caller holds.
+static u64 backend_size(SketchType type, void* backend) {
+  switch(type) {
+    case SketchType::CMS: {
+      CountMinSketch* cms = static_cast<CountMinSketch*>(backend);
+      return cms_table_size(cms) + cms->heap->size();
+    }
+    case SketchType::CS: {
+      CountSketch* cs = static_cast<CountSketch*>(backend);
+      return cs_table_size(cs) + cs->heap->size();
+    }
+    default: break;
+  }
+  return 0;
+}
+
+u64 ConcurrentSketch::Size() {
+  u64 total = 0;
+  {
+    std::lock_guard<std::mutex> guard(merge_lock);
+    total += backend_size(type, merged);
+  }
+  // Owners may be promoting their tables, size each replica under its lock.
+  for (Replica* r : replicas) {
+    std::lock_guard<std::mutex> guard(r->lock);
+    total += backend_size(type, r->backend);
+  }
+  return total;
+}
+
+std::multimap<u64, u64, std::greater<u64>> ConcurrentSketch::HeavyHitters(double phi) {
+  if (epoch_ms == 0) Merge();
+  std::multimap<u64, u64, std::greater<u64>> topK;
+  std::lock_guard<std::mutex> guard(merge_lock);
+  std::vector<HeapElement> items;
+  switch(type) {
+    case SketchType::CMS: items = static_cast<CountMinSketch*>(merged)->heap->getTopK(); break;
+    case SketchType::CS:  items = static_cast<CountSketch*>(merged)->heap->getTopK(); break;
+    default: break;
+  }
+  // Same phi * seen cut as Sketch::HeavyHitters.
+  double threshold = phi * merged_seen;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (items.at(i).count >= threshold) topK.insert({items.at(i).item, items.at(i).count});
+  }
+  return topK;
+}
+
+ConcurrentSketch::~ConcurrentSketch() {
+  if (epoch_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(epoch_lock);
+      stopping = true;
+    }
+    epoch_cv.notify_all();
+    epoch_thread.join();
+  }
+  for (Replica* r : replicas) {
+    switch(type) {
+      case SketchType::CMS: cms_free(static_cast<CountMinSketch*>(r->backend)); break;
+      case SketchType::CS:  cs_free(static_cast<CountSketch*>(r->backend)); break;
+      default: break;
+    }
+    delete r;
+  }
+  switch(type) {
+    case SketchType::CMS: cms_free(static_cast<CountMinSketch*>(merged)); break;
+    case SketchType::CS:  cs_free(static_cast<CountSketch*>(merged)); break;
+    default: break;
+  }
+}
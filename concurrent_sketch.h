@@ -0,0 +1,60 @@
+#ifndef CONCURRENT_SKETCH_H
+#define CONCURRENT_SKETCH_H
+
+#include "sketch.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Sketch for many ingest threads. Every thread owns a private CMS/CS replica
+// (same seeds, so counters line up) with its own top-k heap. A merge sums the
+// replicas' slots into a snapshot sketch and re-scores the union of all the
+// replicas' heap items against it.
+//
+// Each replica has its own lock, taken by its owner once per Add/AddBatch
+// chunk and by the merger for the time it takes to sum one replica, so
+// queries can run while ingest continues.
+class ConcurrentSketch {
+private:
+    struct alignas(64) Replica {
+        std::mutex lock;
+        void* backend;
+        u64 seen; // weight added through this replica
+    };
+
+    std::vector<Replica*> replicas;
+    void* merged; // snapshot, guarded by merge_lock
+    u64 merged_seen; // weight behind the snapshot, guarded by merge_lock
+    std::mutex merge_lock;
+    SketchType type;
+
+    // Epoch timer, only running when epoch_ms > 0.
+    u64 epoch_ms;
+    std::thread epoch_thread;
+    std::mutex epoch_lock;
+    std::condition_variable epoch_cv;
+    bool stopping;
+
+    void EpochLoop();
+
+public:
+    // epoch_ms == 0 merges on demand in HeavyHitters/Estimate, otherwise a
+    // background thread merges every epoch_ms and queries read the last
+    // snapshot.
+    ConcurrentSketch(u64 N, double phi, SketchType type, size_t num_threads,
+                     const SketchConfig& config = SketchConfig(), u64 epoch_ms = 0);
+    void Add(size_t thread, u64 item, u64 weight = 1);
+    void AddBatch(size_t thread, const u64* items, size_t n);
+    void Merge();
+    u64 Estimate(u64 item);
+    u64 Size();
+    std::multimap<u64, u64, std::greater<u64>> HeavyHitters(double phi);
+    ~ConcurrentSketch();
+};
+
+#endif
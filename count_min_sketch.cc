@@ -4,15 +4,55 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <limits>
 #include <math.h>
 #include "min_heap.h"
 #include "sketch.h"
 #include "count_min_sketch.h"
 #include "hashutil.h"
+#include <immintrin.h>
 
 #define ZETA_1_5 2.6123
 
-CountMinSketch* cms_init(u64 N, double phi) {
+// MurmurHash64A constants, see hashutil.c. The batched path below reproduces
+// MurmurHash64A(&item, sizeof(u64), seed) bit for bit.
+#define MURMUR_M 0xc6a4a7935bd1e995ULL
+#define MURMUR_R 47
+
+typedef void (*cms_hash_batch_fn)(const CountMinSketch*, const u64*,
+                                  u64 (*)[CMS_BATCH]);
+
+// Dimensions of a kernel: the template arguments when non zero, so loops and
+// the bucket modulo are compile time constants, else the sketch's own.
+template <u64 D, u64 W>
+struct CmsShape {
+  static const u64 MAX_DEPTH = D ? D : CMS_MAX_DEPTH;
+  static inline u64 depth(const CountMinSketch* sketch) { return D ? D : sketch->depth; }
+  static inline u64 width(const CountMinSketch* sketch) { return W ? W : sketch->width; }
+  static inline u64 bucket(const CountMinSketch* sketch, u64 h) {
+    if (W) return h % W;
+    return sketch->width_mask ? h & sketch->width_mask : h % sketch->width;
+  }
+};
+
+static u64 cms_slots_bytes(const CountMinSketch* sketch) {
+  return sketch->depth * sketch->width * (u64)sketch->counters;
+}
+
+static void cms_free_slots(CountMinSketch* sketch) {
+  table_free(sketch->slots, cms_slots_bytes(sketch), sketch->slots_mem);
+}
+
+static void* cms_alloc_slots(u64 depth, u64 width, CounterWidth counters,
+                             const TableAlloc& alloc, TableMem* mem) {
+  return table_alloc(depth * width * (u64)counters, alloc, mem);
+}
+
+static const CmsKernels* cms_pick_kernels(CounterWidth counters, u64 depth, u64 width);
+
+CountMinSketch* cms_init(u64 N, double phi, HashMode hash_mode, u64 width, u64 depth,
+                         CmsUpdate update, CounterWidth counters, CounterOverflow overflow,
+                         CmsLayout layout, u64 seed, const TableAlloc& alloc) {
   CountMinSketch* sketch = (CountMinSketch*)malloc(sizeof(CountMinSketch));
   if (!sketch) {
     fprintf(stderr, "Unable to allocate memory for sketch");
@@ -22,66 +62,575 @@ CountMinSketch* cms_init(u64 N, double phi) {
     fprintf(stderr, "Phi value can not be zero");
     exit(1);
   }
+  if (depth == 0 || depth > CMS_MAX_DEPTH || width == 0) {
+    fprintf(stderr, "Invalid sketch dimensions %ld x %ld\n", depth, width);
+    exit(1);
+  }
   // K value is caluclated based on the reinmann's zeta function zeta(1.5), which
   // is our zipfian parameter is equal to 2.6123, we assume the universe size is
   // large here >> 10^5.
   sketch->k = (u64) floor(pow( 1.0 / (phi * ZETA_1_5), 2.0/3.0));
   printf("estimated k: %ld\n", sketch->k);
 
-  for (u64 i = 0; i < NUM_HASH_FUNCTIONS; ++i) sketch->m[i] = i + START_SEED;
+  sketch->depth = depth;
+  sketch->width = width;
+  sketch->width_mask = (width & (width - 1)) == 0 ? width - 1 : 0;
+  for (u64 i = 0; i < CMS_MAX_DEPTH; ++i) sketch->m[i] = i + seed;
+  sketch->hash_mode = row_hash_resolve(hash_mode, width, depth, 0);
+  sketch->update = update;
+  sketch->layout = layout;
+  // Blocks are sized for the initial counter width and keep their counters
+  // when the table is promoted, a block then spans two or four lines.
+  sketch->block_cells = 64 / (u64)counters;
+  sketch->blocks = depth * width / sketch->block_cells;
+  if (layout == CmsLayout::BLOCKED && (depth > sketch->block_cells || sketch->blocks == 0 ||
+                                       sketch->blocks > UINT32_MAX)) {
+    fprintf(stderr, "Blocked layout needs depth <= %ld and at least one block\n",
+            sketch->block_cells);
+    exit(1);
+  }
+  sketch->counters = counters;
+  sketch->overflow = overflow;
+  sketch->kernels = cms_pick_kernels(counters, depth, width);
+  sketch->alloc = alloc;
+  sketch->slots = cms_alloc_slots(depth, width, counters, alloc, &sketch->slots_mem);
 
-  memset(sketch->slots, 0 , sizeof(sketch->slots));
+  sketch->heap = new MinHeap(sketch->k);
+  return sketch;
+}
 
+CountMinSketch* cms_init_like(const CountMinSketch* other) {
+  CountMinSketch* sketch = (CountMinSketch*)malloc(sizeof(CountMinSketch));
+  if (!sketch) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  memcpy(sketch, other, sizeof(CountMinSketch));
+  sketch->slots = cms_alloc_slots(other->depth, other->width, other->counters, other->alloc,
+                                  &sketch->slots_mem);
   sketch->heap = new MinHeap(sketch->k);
   return sketch;
 }
 
-bool cms_add(CountMinSketch* sketch, u64 item) {
-  u64 count = UINT64_MAX;
-  for (size_t i = 0 ; i < NUM_HASH_FUNCTIONS; ++i) {
-    u64 index = MurmurHash64A(&item, sizeof(u64), sketch->m[i]) % NUM_BUCKETS;
-    // printf("Key: %ld Seed: %ld Index: %ld\n", item, sketch->m[i], index);
-    if(index > NUM_BUCKETS) {
-      fprintf(stderr, "Couldn't add item to count sketch\n");
-      return false;
+// Blocked layout: the high half of one hash picks a block of block_cells
+// counters, the low bits pick a counter inside it for every row. A row whose
+// pick is already taken by an earlier row gets the next free counter, so no
+// counter is counted twice for one item (needs depth <= block_cells).
+template <u64 D, u64 W>
+static inline void cms_block_rows(const CountMinSketch* sketch, u64 item, u64* index) {
+  typedef CmsShape<D, W> S;
+  u64 h = MurmurHash64A(&item, sizeof(u64), sketch->m[0]);
+  u64 cells = sketch->block_cells;
+  u64 shift = __builtin_ctzll(cells);
+  u64 base = (((h >> 32) * sketch->blocks) >> 32) * cells;
+  u64 bits = h & 0xffffffffULL;
+  u64 left = 32;
+  u64 free = cells == 64 ? ~0ULL : (1ULL << cells) - 1;
+  for (size_t i = 0; i < S::depth(sketch); ++i) {
+    if (left < shift) {
+      bits = MurmurHash64A(&h, sizeof(u64), sketch->m[1]);
+      left = 64;
     }
-    sketch->slots[i][index] += 1;
-    count = MIN(count, sketch->slots[i][index]);
+    u64 sub = bits & (cells - 1);
+    bits >>= shift;
+    left -= shift;
+    // First free counter at or after sub, wrapping around.
+    u64 above = free & (~0ULL << sub);
+    sub = __builtin_ctzll(above ? above : free);
+    free &= ~(1ULL << sub);
+    index[i] = base + sub;
   }
+}
 
-  sketch->heap->insertOrUpdate(item, count);
-  return true;
+// Fills index[i] with the offset in slots of item's counter for row i.
+template <u64 D, u64 W>
+static inline void cms_rows(const CountMinSketch* sketch, u64 item, u64* index) {
+  typedef CmsShape<D, W> S;
+  u64 width = S::width(sketch);
+  if (sketch->layout == CmsLayout::BLOCKED) {
+    cms_block_rows<D, W>(sketch, item, index);
+    return;
+  }
+  switch (sketch->hash_mode) {
+    case HashMode::PER_ROW:
+      for (size_t i = 0; i < S::depth(sketch); ++i)
+        index[i] = i * width + S::bucket(sketch, MurmurHash64A(&item, sizeof(u64), sketch->m[i]));
+      break;
+    case HashMode::DOUBLE: {
+      u64 h1, h2;
+      row_hash_double(item, sketch->m[0], sketch->m[1], &h1, &h2);
+      for (size_t i = 0; i < S::depth(sketch); ++i)
+        index[i] = i * width + S::bucket(sketch, row_hash_double_row(h1, h2, i));
+      break;
+    }
+    case HashMode::SLICED: {
+      u64 h = MurmurHash64A(&item, sizeof(u64), sketch->m[0]);
+      for (size_t i = 0; i < S::depth(sketch); ++i)
+        index[i] = i * width + row_hash_slice(h, width, i);
+      break;
+    }
+  }
 }
 
-u64 cms_estimate(CountMinSketch* sketch, u64 item) {
+// Adds delta to the counters of an item whose counter in row i is
+// slots[index[i * stride]] and stores its new estimate in *count. Returns
+// false, with the table left as it was, when a counter would overflow T and
+// the sketch promotes on overflow. Conservative updates only see delta > 0.
+template <typename T, u64 D, u64 W>
+static inline bool cms_bump(CountMinSketch* sketch, const u64* index, size_t stride,
+                            int64_t delta, u64* count) {
+  typedef CmsShape<D, W> S;
+  T* slots = (T*)sketch->slots;
+  u64 depth = S::depth(sketch);
   u64 min = UINT64_MAX;
-  for (size_t i = 0 ; i < NUM_HASH_FUNCTIONS; ++i) {
-    u64 index = MurmurHash64A(&item, sizeof(u64), sketch->m[i]) % NUM_BUCKETS;
-    if(index > NUM_BUCKETS) {
-      fprintf(stderr, "Couldn't estimate item count\n");
+  if (sketch->update == CmsUpdate::CONSERVATIVE) {
+    // Only raise the counters that are below the new estimate.
+    for (size_t i = 0; i < depth; ++i)
+      min = MIN(min, (u64)slots[index[i * stride]]);
+    if (counter_overflows<T>((T)min, delta)) {
+      if (sketch->overflow == CounterOverflow::PROMOTE) return false;
+      min = std::numeric_limits<T>::max();
+    } else {
+      min += delta;
+    }
+    for (size_t i = 0; i < depth; ++i) {
+      T* slot = &slots[index[i * stride]];
+      if (*slot < min) *slot = (T)min;
+    }
+    *count = min;
+    return true;
+  }
+  for (size_t i = 0 ; i < depth; ++i) {
+    T* slot = &slots[index[i * stride]];
+    if (!counter_add<T>(slot, delta, sketch->overflow)) {
+      // Take back the rows already counted, the caller retries wider.
+      while (i-- > 0) slots[index[i * stride]] -= delta;
       return false;
     }
-    min = MIN(min, sketch->slots[i][index]);
+    min = MIN(min, (u64)*slot);
+  }
+  *count = min;
+  return true;
+}
+
+// Keeps the heap in step with an item whose estimate just became count.
+static inline void cms_track(CountMinSketch* sketch, u64 item, int64_t delta, u64 count) {
+  if (delta < 0) sketch->heap->lower(item, count);
+  // Estimates at or below the heap minimum can not change the heap.
+  else if (count > sketch->heap->threshold()) sketch->heap->insertOrUpdate(item, count);
+}
+
+template <typename T, u64 D, u64 W>
+static bool cms_add_impl(CountMinSketch* sketch, u64 item, int64_t delta) {
+  typedef CmsShape<D, W> S;
+  u64 index[S::MAX_DEPTH];
+  u64 count;
+  cms_rows<D, W>(sketch, item, index);
+  if (!cms_bump<T, D, W>(sketch, index, 1, delta, &count)) {
+    cms_promote(sketch, counter_wider(sketch->counters));
+    return sketch->kernels->add(sketch, item, delta);
+  }
+  cms_track(sketch, item, delta, count);
+  return true;
+}
+
+// Computes index[row][j] for the CMS_BATCH items starting at items.
+template <u64 D, u64 W>
+static void cms_hash_batch_scalar(const CountMinSketch* sketch, const u64* items,
+                                  u64 index[][CMS_BATCH]) {
+  typedef CmsShape<D, W> S;
+  u64 rows[S::MAX_DEPTH];
+  for (size_t j = 0; j < CMS_BATCH; ++j) {
+    cms_rows<D, W>(sketch, items[j], rows);
+    for (size_t i = 0; i < S::depth(sketch); ++i) index[i][j] = rows[i];
+  }
+}
+
+// 64x64 bit multiply by the murmur constant using three 32x32->64 multiplies,
+// AVX2 has no native 64 bit mullo.
+__attribute__((target("avx2")))
+static inline __m256i murmur_mul_avx2(__m256i a) {
+  const __m256i mlo = _mm256_set1_epi64x(MURMUR_M & 0xffffffffULL);
+  const __m256i mhi = _mm256_set1_epi64x(MURMUR_M >> 32);
+  __m256i lo = _mm256_mul_epu32(a, mlo);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), mlo),
+                                   _mm256_mul_epu32(a, mhi));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+template <u64 D, u64 W>
+__attribute__((target("avx2")))
+static void cms_hash_batch_avx2(const CountMinSketch* sketch, const u64* items,
+                                u64 index[][CMS_BATCH]) {
+  typedef CmsShape<D, W> S;
+  u64 hashes[CMS_BATCH];
+  for (size_t j = 0; j < CMS_BATCH; j += 4) {
+    // The key mixing step does not depend on the seed, do it once for all rows.
+    __m256i k = _mm256_loadu_si256((const __m256i*)(items + j));
+    k = murmur_mul_avx2(k);
+    k = _mm256_xor_si256(k, _mm256_srli_epi64(k, MURMUR_R));
+    k = murmur_mul_avx2(k);
+    for (size_t i = 0; i < S::depth(sketch); ++i) {
+      u64 h0 = (u64)(unsigned int)sketch->m[i] ^ (sizeof(u64) * MURMUR_M);
+      __m256i h = _mm256_xor_si256(_mm256_set1_epi64x(h0), k);
+      h = murmur_mul_avx2(h);
+      h = _mm256_xor_si256(h, _mm256_srli_epi64(h, MURMUR_R));
+      h = murmur_mul_avx2(h);
+      h = _mm256_xor_si256(h, _mm256_srli_epi64(h, MURMUR_R));
+      _mm256_storeu_si256((__m256i*)hashes, h);
+      for (size_t l = 0; l < 4; ++l) index[i][j + l] = i * S::width(sketch) + S::bucket(sketch, hashes[l]);
+    }
+  }
+}
+
+template <u64 D, u64 W>
+__attribute__((target("avx512f,avx512dq")))
+static void cms_hash_batch_avx512(const CountMinSketch* sketch, const u64* items,
+                                  u64 index[][CMS_BATCH]) {
+  typedef CmsShape<D, W> S;
+  const __m512i m = _mm512_set1_epi64(MURMUR_M);
+  u64 hashes[8];
+  for (size_t j = 0; j < CMS_BATCH; j += 8) {
+    __m512i k = _mm512_loadu_si512((const void*)(items + j));
+    k = _mm512_mullo_epi64(k, m);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, MURMUR_R));
+    k = _mm512_mullo_epi64(k, m);
+    for (size_t i = 0; i < S::depth(sketch); ++i) {
+      u64 h0 = (u64)(unsigned int)sketch->m[i] ^ (sizeof(u64) * MURMUR_M);
+      __m512i h = _mm512_xor_si512(_mm512_set1_epi64(h0), k);
+      h = _mm512_mullo_epi64(h, m);
+      h = _mm512_xor_si512(h, _mm512_srli_epi64(h, MURMUR_R));
+      h = _mm512_mullo_epi64(h, m);
+      h = _mm512_xor_si512(h, _mm512_srli_epi64(h, MURMUR_R));
+      _mm512_storeu_si512((void*)hashes, h);
+      for (size_t l = 0; l < 8; ++l) index[i][j + l] = i * S::width(sketch) + S::bucket(sketch, hashes[l]);
+    }
+  }
+}
+
+template <u64 D, u64 W>
+static cms_hash_batch_fn cms_pick_hash_batch() {
+  __builtin_cpu_init();
+  if (CMS_BATCH % 8 == 0 && __builtin_cpu_supports("avx512dq"))
+    return cms_hash_batch_avx512<D, W>;
+  if (CMS_BATCH % 4 == 0 && __builtin_cpu_supports("avx2"))
+    return cms_hash_batch_avx2<D, W>;
+  return cms_hash_batch_scalar<D, W>;
+}
+
+template <typename T, u64 D, u64 W>
+static bool cms_add_batch_impl(CountMinSketch* sketch, const u64* items, const u64* weights,
+                               size_t n) {
+  typedef CmsShape<D, W> S;
+  static const cms_hash_batch_fn simd_hash_batch = cms_pick_hash_batch<D, W>();
+  // The SIMD kernels implement the per row murmur mode, the other modes only
+  // hash once or twice per item and stay scalar.
+  cms_hash_batch_fn hash_batch =
+      sketch->hash_mode == HashMode::PER_ROW && sketch->layout == CmsLayout::ROWS ?
+      simd_hash_batch : cms_hash_batch_scalar<D, W>;
+  // Hash and prefetch block b+1 while updating block b, so the cache misses on
+  // slots overlap with useful work.
+  u64 index[2][S::MAX_DEPTH][CMS_BATCH];
+  T* slots = (T*)sketch->slots;
+  // A blocked item's counters share one cache line, prefetch it once.
+  u64 lines = sketch->layout == CmsLayout::BLOCKED ? 1 : S::depth(sketch);
+  size_t blocks = n / CMS_BATCH;
+
+  for (size_t b = 0; b <= blocks; ++b) {
+    if (b < blocks) {
+      u64 (*next)[CMS_BATCH] = index[b & 1];
+      hash_batch(sketch, items + b * CMS_BATCH, next);
+      for (size_t i = 0; i < lines; ++i)
+        for (size_t j = 0; j < CMS_BATCH; ++j)
+          __builtin_prefetch(&slots[next[i][j]], 1);
+    }
+    if (b == 0) continue;
+
+    // Apply updates in stream order so the heap sees exactly what cms_add would.
+    u64 (*cur)[CMS_BATCH] = index[(b - 1) & 1];
+    for (size_t j = 0; j < CMS_BATCH; ++j) {
+      size_t at = (b - 1) * CMS_BATCH + j;
+      int64_t delta = weights ? (int64_t)weights[at] : 1;
+      u64 count;
+      if (!cms_bump<T, D, W>(sketch, &cur[0][j], CMS_BATCH, delta, &count)) {
+        // Finish the stream on the wider table's kernels.
+        cms_promote(sketch, counter_wider(sketch->counters));
+        return cms_add_batch(sketch, items + at, n - at, weights ? weights + at : NULL);
+      }
+      cms_track(sketch, items[at], delta, count);
+    }
+  }
+
+  for (size_t j = blocks * CMS_BATCH; j < n; ++j) {
+    if (!cms_add(sketch, items[j], weights ? weights[j] : 1)) return false;
+  }
+  return true;
+}
+
+template <typename T, u64 D, u64 W>
+static u64 cms_estimate_impl(CountMinSketch* sketch, u64 item) {
+  typedef CmsShape<D, W> S;
+  const T* slots = (const T*)sketch->slots;
+  u64 min = UINT64_MAX;
+  u64 index[S::MAX_DEPTH];
+  cms_rows<D, W>(sketch, item, index);
+  for (size_t i = 0 ; i < S::depth(sketch); ++i) {
+    min = MIN(min, (u64)slots[index[i]]);
   }
 
   return min;
 }
 
+#define CMS_KERNELS(T, D, W) \
+  {(CounterWidth)sizeof(T), D, W, cms_add_impl<T, D, W>, cms_add_batch_impl<T, D, W>, \
+   cms_estimate_impl<T, D, W>},
+
+// Specializations for the compiled in default and the power of two widths we
+// sweep in the experiments, the (0, 0) entry handles every other size.
+#define CMS_KERNELS_FOR(T) \
+  CMS_KERNELS(T, NUM_HASH_FUNCTIONS, NUM_BUCKETS) \
+  CMS_KERNELS(T, 5, 512) \
+  CMS_KERNELS(T, 5, 1024) \
+  CMS_KERNELS(T, 5, 2048) \
+  CMS_KERNELS(T, 5, 4096) \
+  CMS_KERNELS(T, 5, 8192) \
+  CMS_KERNELS(T, 5, 65536) \
+  CMS_KERNELS(T, 5, 1048576) \
+  CMS_KERNELS(T, 0, 0)
+
+static const CmsKernels cms_kernels[] = {
+  CMS_KERNELS_FOR(u64)
+  CMS_KERNELS_FOR(uint32_t)
+  CMS_KERNELS_FOR(uint16_t)
+};
+
+static const CmsKernels* cms_pick_kernels(CounterWidth counters, u64 depth, u64 width) {
+  const CmsKernels* fallback = NULL;
+  for (const CmsKernels& k : cms_kernels) {
+    if (k.counters != counters) continue;
+    if (k.depth == depth && k.width == width) return &k;
+    if (k.depth == 0) fallback = &k;
+  }
+  return fallback;
+}
+
+void cms_promote(CountMinSketch* sketch, CounterWidth counters) {
+  if (counters <= sketch->counters) return;
+  size_t cells = sketch->depth * sketch->width;
+  TableMem mem;
+  void* slots = cms_alloc_slots(sketch->depth, sketch->width, counters, sketch->alloc, &mem);
+  switch (sketch->counters) {
+    case CounterWidth::BITS16:
+      if (counters == CounterWidth::BITS32)
+        counter_widen<uint16_t, uint32_t>(sketch->slots, slots, cells);
+      else
+        counter_widen<uint16_t, u64>(sketch->slots, slots, cells);
+      break;
+    case CounterWidth::BITS32:
+      counter_widen<uint32_t, u64>(sketch->slots, slots, cells);
+      break;
+    case CounterWidth::BITS64: break;
+  }
+  cms_free_slots(sketch);
+  sketch->slots = slots;
+  sketch->slots_mem = mem;
+  sketch->counters = counters;
+  sketch->kernels = cms_pick_kernels(counters, sketch->depth, sketch->width);
+}
+
+bool cms_add(CountMinSketch* sketch, u64 item, u64 weight) {
+  return sketch->kernels->add(sketch, item, (int64_t)weight);
+}
+
+bool cms_update(CountMinSketch* sketch, u64 item, int64_t delta) {
+  if (delta < 0 && sketch->update == CmsUpdate::CONSERVATIVE) return false;
+  return sketch->kernels->add(sketch, item, delta);
+}
+
+bool cms_add_batch(CountMinSketch* sketch, const u64* items, size_t n, const u64* weights) {
+  return sketch->kernels->add_batch(sketch, items, weights, n);
+}
+
+u64 cms_estimate(CountMinSketch* sketch, u64 item) {
+  return sketch->kernels->estimate(sketch, item);
+}
+
+static void cms_combine_slots(CountMinSketch* dst, const CountMinSketch* src, bool subtract) {
+  cms_promote(dst, src->counters);
+  size_t cells = dst->depth * dst->width;
+  CounterOverflow of = dst->overflow;
+  bool merged = true;
+  switch (dst->counters) {
+    case CounterWidth::BITS16:
+      merged = counter_merge<uint16_t, uint16_t>(dst->slots, src->slots, cells, of, subtract);
+      break;
+    case CounterWidth::BITS32:
+      merged = src->counters == CounterWidth::BITS16 ?
+        counter_merge<uint32_t, uint16_t>(dst->slots, src->slots, cells, of, subtract) :
+        counter_merge<uint32_t, uint32_t>(dst->slots, src->slots, cells, of, subtract);
+      break;
+    case CounterWidth::BITS64:
+      if (src->counters == CounterWidth::BITS16)
+        counter_merge<u64, uint16_t>(dst->slots, src->slots, cells, of, subtract);
+      else if (src->counters == CounterWidth::BITS32)
+        counter_merge<u64, uint32_t>(dst->slots, src->slots, cells, of, subtract);
+      else
+        counter_merge<u64, u64>(dst->slots, src->slots, cells, of, subtract);
+      break;
+  }
+  if (!merged) {
+    cms_promote(dst, counter_wider(dst->counters));
+    cms_combine_slots(dst, src, subtract);
+  }
+}
+
+bool cms_compatible(const CountMinSketch* a, const CountMinSketch* b) {
+  return a->depth == b->depth && a->width == b->width && a->hash_mode == b->hash_mode &&
+         a->layout == b->layout && a->block_cells == b->block_cells &&
+         memcmp(a->m, b->m, sizeof(a->m)) == 0;
+}
+
+void cms_merge_slots(CountMinSketch* dst, const CountMinSketch* src) {
+  cms_combine_slots(dst, src, false);
+}
+
+void cms_subtract_slots(CountMinSketch* dst, const CountMinSketch* src) {
+  cms_combine_slots(dst, src, true);
+}
+
+static bool cms_combine(CountMinSketch* dst, const CountMinSketch* src, bool subtract) {
+  if (!cms_compatible(dst, src)) return false;
+  std::vector<HeapElement> candidates = dst->heap->getTopK();
+  std::vector<HeapElement> theirs = src->heap->getTopK();
+  candidates.insert(candidates.end(), theirs.begin(), theirs.end());
+  cms_combine_slots(dst, src, subtract);
+  dst->heap->clear();
+  for (const HeapElement& e : candidates) {
+    u64 count = cms_estimate(dst, e.item);
+    if (count > dst->heap->threshold()) dst->heap->insertOrUpdate(e.item, count);
+  }
+  return true;
+}
+
+bool cms_merge(CountMinSketch* dst, const CountMinSketch* src) {
+  return cms_combine(dst, src, false);
+}
+
+bool cms_subtract(CountMinSketch* dst, const CountMinSketch* src) {
+  return cms_combine(dst, src, true);
+}
+
+void cms_clear(CountMinSketch* sketch) {
+  memset(sketch->slots, 0 , cms_slots_bytes(sketch));
+  sketch->heap->clear();
+}
+
 void cms_free(CountMinSketch* sketch) {
   delete sketch->heap;
+  cms_free_slots(sketch);
   free(sketch);
 }
 
+bool cms_serialize(const CountMinSketch* sketch, SerWriter* w) {
+  ser_put_u64(w, sketch->k);
+  ser_put_u64(w, (u64)sketch->hash_mode);
+  ser_put_u64(w, (u64)sketch->update);
+  ser_put_u64(w, (u64)sketch->layout);
+  ser_put_u64(w, (u64)sketch->counters);
+  ser_put_u64(w, (u64)sketch->overflow);
+  ser_put_u64(w, sketch->depth);
+  ser_put_u64(w, sketch->width);
+  ser_put_u64(w, sketch->block_cells);
+  ser_put_u64(w, sketch->blocks);
+  for (size_t i = 0; i < CMS_MAX_DEPTH; ++i) ser_put_u64(w, sketch->m[i]);
+  // Only the heap's items, counts come back from the table.
+  std::vector<HeapElement> top = sketch->heap->getTopK();
+  ser_put_u64(w, top.size());
+  for (const HeapElement& e : top) {
+    ser_put_u64(w, e.item);
+    ser_put_u64(w, e.count);
+  }
+  ser_pad(w, SER_PAGE);
+  ser_put_counters(w, sketch->slots, sketch->depth * sketch->width, (u64)sketch->counters);
+  return w->ok;
+}
+
+CountMinSketch* cms_load(SerReader* r) {
+  CountMinSketch* sketch = (CountMinSketch*)malloc(sizeof(CountMinSketch));
+  if (!sketch) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  sketch->k = ser_get_u64(r);
+  u64 hash_mode = ser_get_u64(r);
+  u64 update = ser_get_u64(r);
+  u64 layout = ser_get_u64(r);
+  u64 counters = ser_get_u64(r);
+  u64 overflow = ser_get_u64(r);
+  sketch->depth = ser_get_u64(r);
+  sketch->width = ser_get_u64(r);
+  sketch->block_cells = ser_get_u64(r);
+  sketch->blocks = ser_get_u64(r);
+  for (size_t i = 0; i < CMS_MAX_DEPTH; ++i) sketch->m[i] = ser_get_u64(r);
+  u64 heap_items = ser_get_u64(r);
+
+  u64 width = sketch->width;
+  bool valid = r->ok && hash_mode <= (u64)HashMode::SLICED &&
+      update <= (u64)CmsUpdate::CONSERVATIVE && layout <= (u64)CmsLayout::BLOCKED &&
+      (counters == 2 || counters == 4 || counters == 8) &&
+      overflow <= (u64)CounterOverflow::SATURATE &&
+      sketch->depth > 0 && sketch->depth <= CMS_MAX_DEPTH && width > 0 &&
+      width <= r->size && sketch->k <= UINT32_MAX && heap_items <= sketch->k;
+  if (valid && (CmsLayout)layout == CmsLayout::BLOCKED) {
+    u64 cells = sketch->block_cells;
+    valid = (cells == 8 || cells == 16 || cells == 32) && sketch->depth <= cells &&
+            sketch->blocks == sketch->depth * width / cells && sketch->blocks > 0 &&
+            sketch->blocks <= UINT32_MAX;
+  }
+  if (!valid) {
+    free(sketch);
+    return NULL;
+  }
+  std::vector<HeapElement> top(heap_items);
+  for (u64 i = 0; i < heap_items; ++i) {
+    top[i].item = ser_get_u64(r);
+    top[i].count = ser_get_u64(r);
+  }
+
+  sketch->hash_mode = (HashMode)hash_mode;
+  sketch->update = (CmsUpdate)update;
+  sketch->layout = (CmsLayout)layout;
+  sketch->counters = (CounterWidth)counters;
+  sketch->overflow = (CounterOverflow)overflow;
+  sketch->width_mask = (width & (width - 1)) == 0 ? width - 1 : 0;
+  sketch->kernels = cms_pick_kernels(sketch->counters, sketch->depth, width);
+  bool mapped;
+  sketch->slots = ser_get_counters(r, sketch->depth * width, counters, SER_PAGE, &mapped);
+  sketch->slots_mem = mapped ? TableMem::MMAP : TableMem::HEAP;
+  sketch->alloc = TableAlloc();
+  if (!sketch->slots) {
+    free(sketch);
+    return NULL;
+  }
+  sketch->heap = new MinHeap(sketch->k);
+  for (const HeapElement& e : top) sketch->heap->insertOrUpdate(e.item, e.count);
+  return sketch;
+}
+
 void cms_print_sketch_table(CountMinSketch* sketch) {
-  for (size_t i = 0; i < NUM_HASH_FUNCTIONS ; ++i) {
-    for (size_t j = 0; j < NUM_BUCKETS; ++j)
-      printf("%ld    " , sketch->slots[i][j]);
+  for (size_t i = 0; i < sketch->depth ; ++i) {
+    for (size_t j = 0; j < sketch->width; ++j)
+      printf("%ld    " , cms_slot(sketch, i, j));
     printf("\n");
   }
 }
 
+u64 cms_table_size(const CountMinSketch* sketch) {
+  return sizeof(*sketch) + table_resident(sketch->slots, cms_slots_bytes(sketch));
+}
+
 u64 cms_size(CountMinSketch* sketch) {
-  u64 base = sizeof(*sketch);
+  u64 base = cms_table_size(sketch);
   printf("Size of Sketch without heap: %ld\n", base);
   base += sketch->heap->size();
   return base;
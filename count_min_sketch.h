@@ -1,9 +1,15 @@
+#include "counter.h"
 #include "min_heap.h"
+#include "row_hash.h"
+#include "serialize.h"
+#include "table_alloc.h"
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef _CMS_H_
 #define _CMS_H_
 
+// Default dimensions, used when cms_init is not given any.
 #ifndef NUM_HASH_FUNCTIONS
 #define NUM_HASH_FUNCTIONS 5
 #endif
@@ -12,30 +18,147 @@
 #define NUM_BUCKETS 2048 // Must be power of two
 #endif
 
+#ifndef CMS_MAX_DEPTH
+#define CMS_MAX_DEPTH 32 // Upper bound on rows for runtime sized sketches
+#endif
+
+#ifndef CMS_BATCH
+#define CMS_BATCH 16 // Items hashed together by cms_add_batch, multiple of 8
+#endif
+
 #define START_SEED 42069
 #define HEAP_START_CAP NUM_BUCKETS
 #define u64 uint64_t
 
 #define MIN(X, Y) X < Y ? X : Y
 
+enum class CmsUpdate {
+  STANDARD,     // add the weight to the item's counter in every row, turnstile capable
+  CONSERVATIVE, // raise the item's counters only up to min + weight, inserts only
+};
+
+// Where an item's counters live.
+enum class CmsLayout {
+  ROWS,    // one counter in each of the depth rows, depth cache lines per update
+  BLOCKED, // all depth counters inside one 64 byte block picked by one hash
+};
+
+struct CountMinSketch;
+
+// Update/query kernels compiled for one (counter width, depth, width).
+// cms_init picks a specialization with the dimensions baked in when one
+// exists, else the runtime sized one for its counter width.
 typedef struct {
-  u64 m[NUM_HASH_FUNCTIONS]; // hash seeds array
+  CounterWidth counters;
+  u64 depth; // 0 for the runtime sized kernels
+  u64 width;
+  bool (*add)(CountMinSketch* sketch, u64 item, int64_t delta);
+  bool (*add_batch)(CountMinSketch* sketch, const u64* items, const u64* weights, size_t n);
+  u64 (*estimate)(CountMinSketch* sketch, u64 item);
+} CmsKernels;
+
+typedef struct CountMinSketch {
+  u64 m[CMS_MAX_DEPTH]; // hash seeds array
   u64 k; // used for storing k heavy hitters
-  u64 slots[NUM_HASH_FUNCTIONS][NUM_BUCKETS]; // slot values can be negative
+  HashMode hash_mode;
+  CmsUpdate update;
+  CmsLayout layout;
+  u64 block_cells; // counters per block (BLOCKED)
+  u64 blocks; // number of blocks (BLOCKED)
+  u64 depth; // rows
+  u64 width; // buckets per row
+  u64 width_mask; // width - 1 when width is a power of two, else 0
+  CounterWidth counters; // current counter width, only grows under PROMOTE
+  CounterOverflow overflow;
+  void *slots; // depth rows of width counters, one 64 byte aligned allocation
+  TableMem slots_mem; // how slots was obtained, a file mapping after cms_load
+  TableAlloc alloc; // placement of slots, kept for cms_init_like and promotion
+  const CmsKernels *kernels;
   MinHeap *heap;
 } CountMinSketch;
 
 
-CountMinSketch* cms_init(u64 N, double phi);
+CountMinSketch* cms_init(u64 N, double phi, HashMode hash_mode = HashMode::PER_ROW,
+                         u64 width = NUM_BUCKETS, u64 depth = NUM_HASH_FUNCTIONS,
+                         CmsUpdate update = CmsUpdate::STANDARD,
+                         CounterWidth counters = CounterWidth::BITS64,
+                         CounterOverflow overflow = CounterOverflow::PROMOTE,
+                         CmsLayout layout = CmsLayout::ROWS, u64 seed = START_SEED,
+                         const TableAlloc& alloc = TableAlloc());
+
+// Empty sketch with the same seeds, dimensions, k and hash mode as other, so
+// the two can be merged.
+CountMinSketch* cms_init_like(const CountMinSketch* other);
+
+// Counts weight occurrences of item (at most INT64_MAX) in one update.
+bool cms_add(CountMinSketch* sketch, u64 item, u64 weight = 1);
+
+// Turnstile update: delta may be negative to take earlier occurrences back,
+// counters stop at zero. Needs standard updates, a conservative sketch
+// rejects negative deltas (returns false). The heap lowers the item's count
+// but keeps the item.
+bool cms_update(CountMinSketch* sketch, u64 item, int64_t delta);
 
-bool cms_add(CountMinSketch* sketch, u64 item);
+// Same result as calling cms_add on each item in order (with weights[i] when
+// weights is not NULL), but hashes CMS_BATCH items at a time with
+// AVX2/AVX-512 (when the CPU has it) and prefetches the counters before
+// touching them.
+bool cms_add_batch(CountMinSketch* sketch, const u64* items, size_t n,
+                   const u64* weights = NULL);
 
 u64 cms_estimate(CountMinSketch* sketch, u64 item);
 
+// Counter of row i, bucket j.
+static inline u64 cms_slot(const CountMinSketch* sketch, u64 i, u64 j) {
+  u64 cell = i * sketch->width + j;
+  switch (sketch->counters) {
+    case CounterWidth::BITS16: return ((const uint16_t*)sketch->slots)[cell];
+    case CounterWidth::BITS32: return ((const uint32_t*)sketch->slots)[cell];
+    case CounterWidth::BITS64: break;
+  }
+  return ((const u64*)sketch->slots)[cell];
+}
+
+// Widens every counter to the given width and switches to its kernels.
+void cms_promote(CountMinSketch* sketch, CounterWidth counters);
+
+// True when a and b send every item to the same counters (seeds, dimensions,
+// hash mode and layout match), so their tables can be combined.
+bool cms_compatible(const CountMinSketch* a, const CountMinSketch* b);
+
+// Adds src's counters into dst. The two must be cms_compatible, their counter
+// widths may differ (dst is promoted to fit). The heap of dst is left
+// untouched.
+void cms_merge_slots(CountMinSketch* dst, const CountMinSketch* src);
+
+// Subtracts src's counters from dst, stopping at zero. Meant for deltas where
+// src saw a prefix of dst's stream.
+void cms_subtract_slots(CountMinSketch* dst, const CountMinSketch* src);
+
+// cms_merge_slots/cms_subtract_slots plus a new heap: the union of both heaps'
+// items re-scored against the combined table. False, with dst untouched, if
+// the sketches are not compatible.
+bool cms_merge(CountMinSketch* dst, const CountMinSketch* src);
+bool cms_subtract(CountMinSketch* dst, const CountMinSketch* src);
+
+// Zeroes the counters and empties the heap.
+void cms_clear(CountMinSketch* sketch);
+
 void cms_free(CountMinSketch* sketch);
 
+// Writes the parameters, seeds, heap items and counter table, see serialize.h.
+bool cms_serialize(const CountMinSketch* sketch, SerWriter* w);
+
+// Reads a sketch written by cms_serialize. The counter table is mapped from
+// the file without copying, only the heap is rebuilt from its saved entries.
+// Returns NULL on a malformed or truncated file.
+CountMinSketch* cms_load(SerReader* r);
+
 void cms_print_sketch_table(CountMinSketch* sketch);
 
+// Struct and resident counter table bytes, the heap left out.
+u64 cms_table_size(const CountMinSketch* sketch);
+
 u64 cms_size(CountMinSketch* sketch);
 
 #endif
@@ -2,7 +2,6 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
-#include <random>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -13,13 +12,55 @@
 
 #define ZETA_1_5 2.6123
 
-CountSketch* cs_init(u64 N, double phi) {
+// Dimensions of a kernel, see CmsShape.
+template <u64 D, u64 W>
+struct CsShape {
+  static const u64 MAX_DEPTH = D ? D : CS_MAX_DEPTH;
+  static inline u64 depth(const CountSketch* sketch) { return D ? D : sketch->depth; }
+  static inline u64 width(const CountSketch* sketch) { return W ? W : sketch->width; }
+  static inline u64 bucket(const CountSketch* sketch, u64 h) {
+    if (W) return h % W;
+    return sketch->width_mask ? h & sketch->width_mask : h % sketch->width;
+  }
+};
+
+static u64 cs_slots_bytes(const CountSketch* sketch) {
+  return sketch->depth * sketch->width * (u64)sketch->counters;
+}
+
+static void cs_free_slots(CountSketch* sketch) {
+  table_free(sketch->slots, cs_slots_bytes(sketch), sketch->slots_mem);
+}
+
+static void* cs_alloc_slots(u64 depth, u64 width, CounterWidth counters,
+                            const TableAlloc& alloc, TableMem* mem) {
+  return table_alloc(depth * width * (u64)counters, alloc, mem);
+}
+
+static const CsKernels* cs_pick_kernels(CounterWidth counters, u64 depth, u64 width);
+
+CountSketch* cs_init(u64 N, double phi, HashMode hash_mode, u64 width, u64 depth,
+                     CounterWidth counters, CounterOverflow overflow, u64 seed,
+                     const TableAlloc& alloc) {
+  if (depth == 0 || depth > CS_MAX_DEPTH || width == 0) {
+    fprintf(stderr, "Invalid sketch dimensions %ld x %ld\n", depth, width);
+    exit(1);
+  }
   CountSketch *cs = (CountSketch*) malloc(sizeof(CountSketch));
-  std::random_device rd;
-  for (size_t i = 0; i < NUM_HASH_FUNCTION_PAIRS; ++i) {
-    cs->seeds[i].seed_main = rd();
-    cs->seeds[i].seed_sign = rd();
+  // Same seed, same hash functions: sketches built apart can be merged.
+  u64 state = seed;
+  for (size_t i = 0; i < CS_MAX_DEPTH; ++i) {
+    cs->seeds[i].seed_main = row_hash_next_seed(&state);
+    cs->seeds[i].seed_sign = row_hash_next_seed(&state);
   }
+  cs->depth = depth;
+  cs->width = width;
+  cs->width_mask = (width & (width - 1)) == 0 ? width - 1 : 0;
+  // SLICED needs one extra bit per row for the sign.
+  cs->hash_mode = row_hash_resolve(hash_mode, width, depth, depth);
+  cs->counters = counters;
+  cs->overflow = overflow;
+  cs->kernels = cs_pick_kernels(counters, depth, width);
 
   // K value is caluclated based on the reinmann's zeta function zeta(1.5), which
   // is our zipfian parameter is equal to 2.6123, we assume the universe size is
@@ -27,18 +68,25 @@ CountSketch* cs_init(u64 N, double phi) {
   cs->k = (u64) floor(pow( 1.0 / (phi * ZETA_1_5), 2.0/3.0));
   printf("estimated k: %ld\n", cs->k);
 
-  memset(cs->slots, 0, sizeof(cs->slots));
+  cs->alloc = alloc;
+  cs->slots = cs_alloc_slots(depth, width, counters, alloc, &cs->slots_mem);
   cs->heap = new MinHeap(cs->k);
   return cs;
 }
 
-void cs_hash(HashPair* pair, u64 item, size_t *bucket, i64 *sign) {
-  if (item > static_cast<u64>(std::numeric_limits<i64>::max())) {
-    fprintf(stderr, "Unsigned value is out of range for int64 %ld", item);
-    return;
-  }
+CountSketch* cs_init_like(const CountSketch* other) {
+  CountSketch *cs = (CountSketch*) malloc(sizeof(CountSketch));
+  memcpy(cs, other, sizeof(CountSketch));
+  cs->slots = cs_alloc_slots(other->depth, other->width, other->counters, other->alloc,
+                            &cs->slots_mem);
+  cs->heap = new MinHeap(cs->k);
+  return cs;
+}
 
-  *bucket = MurmurHash64A(&item, sizeof(u64), pair->seed_main) % CS_NUM_BUCKETS;
+template <u64 D, u64 W>
+static inline void cs_hash(const CountSketch* sketch, const HashPair* pair, u64 item,
+                           size_t *bucket, i64 *sign) {
+  *bucket = CsShape<D, W>::bucket(sketch, MurmurHash64A(&item, sizeof(u64), pair->seed_main));
   if(MurmurHash64A(&item, sizeof(u64), pair->seed_sign) % 2 == 0) {
     *sign = -1;
   } else {
@@ -46,19 +94,63 @@ void cs_hash(HashPair* pair, u64 item, size_t *bucket, i64 *sign) {
   }
 }
 
-bool cs_add(CountSketch* sketch, u64 item) {
-  size_t bucket;
-  i64 sign = 1;
-  for (size_t i = 0; i < NUM_HASH_FUNCTION_PAIRS; ++i) {
-    cs_hash(&sketch->seeds[i], item, &bucket, &sign);
-    if(bucket > CS_NUM_BUCKETS) {
-      fprintf(stderr, "Couldn't add item to count sketch\n");
-      return false;
+// Fills the bucket and sign of item for every row.
+template <u64 D, u64 W>
+static inline void cs_rows(CountSketch* sketch, u64 item, size_t* buckets, i64* signs) {
+  typedef CsShape<D, W> S;
+  u64 depth = S::depth(sketch);
+  switch (sketch->hash_mode) {
+    case HashMode::PER_ROW:
+      for (size_t i = 0; i < depth; ++i)
+        cs_hash<D, W>(sketch, &sketch->seeds[i], item, &buckets[i], &signs[i]);
+      break;
+    case HashMode::DOUBLE: {
+      // The top bit of each row's combined hash is the sign, the low bits
+      // pick the bucket.
+      u64 h1, h2;
+      row_hash_double(item, sketch->seeds[0].seed_main, sketch->seeds[0].seed_sign, &h1, &h2);
+      for (size_t i = 0; i < depth; ++i) {
+        u64 g = row_hash_double_row(h1, h2, i);
+        buckets[i] = S::bucket(sketch, g);
+        signs[i] = (g >> 63) ? 1 : -1;
+      }
+      break;
+    }
+    case HashMode::SLICED: {
+      u64 h = MurmurHash64A(&item, sizeof(u64), sketch->seeds[0].seed_main);
+      u64 sign_bits = h >> (64 - depth);
+      for (size_t i = 0; i < depth; ++i) {
+        buckets[i] = row_hash_slice(h, S::width(sketch), i);
+        signs[i] = ((sign_bits >> i) & 1) ? 1 : -1;
+      }
+      break;
+    }
+  }
+}
+
+template <typename T, u64 D, u64 W>
+static u64 cs_estimate_impl(CountSketch* sketch, u64 item);
+
+template <typename T, u64 D, u64 W>
+static bool cs_add_impl(CountSketch* sketch, u64 item, i64 delta) {
+  typedef CsShape<D, W> S;
+  size_t buckets[S::MAX_DEPTH];
+  i64 signs[S::MAX_DEPTH];
+  T* slots = (T*)sketch->slots;
+  u64 width = S::width(sketch);
+  cs_rows<D, W>(sketch, item, buckets, signs);
+  for (size_t i = 0; i < S::depth(sketch); ++i) {
+    T* slot = &slots[i * width + buckets[i]];
+    if (!counter_add<T>(slot, signs[i] * delta, sketch->overflow)) {
+      // Take back the rows already counted and redo the update wider.
+      while (i-- > 0) slots[i * width + buckets[i]] -= signs[i] * delta;
+      cs_promote(sketch, counter_wider(sketch->counters));
+      return sketch->kernels->add(sketch, item, delta);
     }
-    sketch->slots[i][bucket] += sign;
   }
-  u64 count = cs_estimate(sketch, item);
-  sketch->heap->insertOrUpdate(item, count);
+  u64 count = cs_estimate_impl<T, D, W>(sketch, item);
+  if (delta < 0) sketch->heap->lower(item, count);
+  else if (count > sketch->heap->threshold()) sketch->heap->insertOrUpdate(item, count);
   return true;
 }
 
@@ -80,23 +172,23 @@ int cs_i64_compare(const void* a, const void* b) {
     }
 }
 
-u64 cs_estimate(CountSketch* sketch, u64 item) {
-  size_t bucket;
-  i64 sign = 1;
-  i64 counts[NUM_HASH_FUNCTION_PAIRS];
-  for (size_t i = 0 ; i < NUM_HASH_FUNCTION_PAIRS; ++i) {
-    cs_hash(&sketch->seeds[i], item, &bucket, &sign);
-    if(bucket > CS_NUM_BUCKETS) {
-      fprintf(stderr, "Couldn't estimate item count\n");
-      return false;
-    }
-    counts[i] = sketch->slots[i][bucket];
+template <typename T, u64 D, u64 W>
+static u64 cs_estimate_impl(CountSketch* sketch, u64 item) {
+  typedef CsShape<D, W> S;
+  const T* slots = (const T*)sketch->slots;
+  size_t buckets[S::MAX_DEPTH];
+  i64 signs[S::MAX_DEPTH];
+  i64 counts[S::MAX_DEPTH];
+  u64 depth = S::depth(sketch);
+  u64 width = S::width(sketch);
+  cs_rows<D, W>(sketch, item, buckets, signs);
+  for (size_t i = 0 ; i < depth; ++i) {
+    counts[i] = signs[i] * slots[i * width + buckets[i]];
   }
   // THis is basically a faster sort for small number of elements
-  std::nth_element(counts, counts + NUM_HASH_FUNCTION_PAIRS/2,
-                   counts + NUM_HASH_FUNCTION_PAIRS);
+  std::nth_element(counts, counts + depth/2, counts + depth);
 
-  i64 median = counts[NUM_HASH_FUNCTION_PAIRS/2];
+  i64 median = counts[depth/2];
   if (median > 0){
     return (u64) median;
   }
@@ -104,13 +196,227 @@ u64 cs_estimate(CountSketch* sketch, u64 item) {
   return 0;
 }
 
+#define CS_KERNELS(T, D, W) \
+  {(CounterWidth)sizeof(T), D, W, cs_add_impl<T, D, W>, cs_estimate_impl<T, D, W>},
+
+// Specializations for the compiled in default and the power of two widths we
+// sweep in the experiments, the (0, 0) entry handles every other size.
+#define CS_KERNELS_FOR(T) \
+  CS_KERNELS(T, NUM_HASH_FUNCTION_PAIRS, CS_NUM_BUCKETS) \
+  CS_KERNELS(T, 5, 512) \
+  CS_KERNELS(T, 5, 1024) \
+  CS_KERNELS(T, 5, 2048) \
+  CS_KERNELS(T, 5, 4096) \
+  CS_KERNELS(T, 5, 8192) \
+  CS_KERNELS(T, 5, 65536) \
+  CS_KERNELS(T, 0, 0)
+
+static const CsKernels cs_kernels[] = {
+  CS_KERNELS_FOR(i64)
+  CS_KERNELS_FOR(int32_t)
+  CS_KERNELS_FOR(int16_t)
+};
+
+static const CsKernels* cs_pick_kernels(CounterWidth counters, u64 depth, u64 width) {
+  const CsKernels* fallback = NULL;
+  for (const CsKernels& k : cs_kernels) {
+    if (k.counters != counters) continue;
+    if (k.depth == depth && k.width == width) return &k;
+    if (k.depth == 0) fallback = &k;
+  }
+  return fallback;
+}
+
+void cs_promote(CountSketch* sketch, CounterWidth counters) {
+  if (counters <= sketch->counters) return;
+  size_t cells = sketch->depth * sketch->width;
+  TableMem mem;
+  void* slots = cs_alloc_slots(sketch->depth, sketch->width, counters, sketch->alloc, &mem);
+  switch (sketch->counters) {
+    case CounterWidth::BITS16:
+      if (counters == CounterWidth::BITS32)
+        counter_widen<int16_t, int32_t>(sketch->slots, slots, cells);
+      else
+        counter_widen<int16_t, i64>(sketch->slots, slots, cells);
+      break;
+    case CounterWidth::BITS32:
+      counter_widen<int32_t, i64>(sketch->slots, slots, cells);
+      break;
+    case CounterWidth::BITS64: break;
+  }
+  cs_free_slots(sketch);
+  sketch->slots = slots;
+  sketch->slots_mem = mem;
+  sketch->counters = counters;
+  sketch->kernels = cs_pick_kernels(counters, sketch->depth, sketch->width);
+}
+
+bool cs_add(CountSketch* sketch, u64 item, u64 weight) {
+  return sketch->kernels->add(sketch, item, (i64)weight);
+}
+
+bool cs_update(CountSketch* sketch, u64 item, i64 delta) {
+  return sketch->kernels->add(sketch, item, delta);
+}
+
+u64 cs_estimate(CountSketch* sketch, u64 item) {
+  return sketch->kernels->estimate(sketch, item);
+}
+
+static void cs_combine_slots(CountSketch* dst, const CountSketch* src, bool subtract) {
+  cs_promote(dst, src->counters);
+  size_t cells = dst->depth * dst->width;
+  CounterOverflow of = dst->overflow;
+  bool merged = true;
+  switch (dst->counters) {
+    case CounterWidth::BITS16:
+      merged = counter_merge<int16_t, int16_t>(dst->slots, src->slots, cells, of, subtract);
+      break;
+    case CounterWidth::BITS32:
+      merged = src->counters == CounterWidth::BITS16 ?
+        counter_merge<int32_t, int16_t>(dst->slots, src->slots, cells, of, subtract) :
+        counter_merge<int32_t, int32_t>(dst->slots, src->slots, cells, of, subtract);
+      break;
+    case CounterWidth::BITS64:
+      if (src->counters == CounterWidth::BITS16)
+        counter_merge<i64, int16_t>(dst->slots, src->slots, cells, of, subtract);
+      else if (src->counters == CounterWidth::BITS32)
+        counter_merge<i64, int32_t>(dst->slots, src->slots, cells, of, subtract);
+      else
+        counter_merge<i64, i64>(dst->slots, src->slots, cells, of, subtract);
+      break;
+  }
+  if (!merged) {
+    cs_promote(dst, counter_wider(dst->counters));
+    cs_combine_slots(dst, src, subtract);
+  }
+}
+
+bool cs_compatible(const CountSketch* a, const CountSketch* b) {
+  return a->depth == b->depth && a->width == b->width && a->hash_mode == b->hash_mode &&
+         memcmp(a->seeds, b->seeds, sizeof(a->seeds)) == 0;
+}
+
+void cs_merge_slots(CountSketch* dst, const CountSketch* src) {
+  cs_combine_slots(dst, src, false);
+}
+
+void cs_subtract_slots(CountSketch* dst, const CountSketch* src) {
+  cs_combine_slots(dst, src, true);
+}
+
+static bool cs_combine(CountSketch* dst, const CountSketch* src, bool subtract) {
+  if (!cs_compatible(dst, src)) return false;
+  std::vector<HeapElement> candidates = dst->heap->getTopK();
+  std::vector<HeapElement> theirs = src->heap->getTopK();
+  candidates.insert(candidates.end(), theirs.begin(), theirs.end());
+  cs_combine_slots(dst, src, subtract);
+  dst->heap->clear();
+  for (const HeapElement& e : candidates) {
+    u64 count = cs_estimate(dst, e.item);
+    if (count > dst->heap->threshold()) dst->heap->insertOrUpdate(e.item, count);
+  }
+  return true;
+}
+
+bool cs_merge(CountSketch* dst, const CountSketch* src) {
+  return cs_combine(dst, src, false);
+}
+
+bool cs_subtract(CountSketch* dst, const CountSketch* src) {
+  return cs_combine(dst, src, true);
+}
+
+void cs_clear(CountSketch* sketch) {
+  memset(sketch->slots, 0, cs_slots_bytes(sketch));
+  sketch->heap->clear();
+}
+
 void cs_free(CountSketch* sketch) {
   delete sketch->heap;
+  cs_free_slots(sketch);
   free(sketch);
 }
 
+bool cs_serialize(const CountSketch* sketch, SerWriter* w) {
+  ser_put_u64(w, sketch->k);
+  ser_put_u64(w, (u64)sketch->hash_mode);
+  ser_put_u64(w, (u64)sketch->counters);
+  ser_put_u64(w, (u64)sketch->overflow);
+  ser_put_u64(w, sketch->depth);
+  ser_put_u64(w, sketch->width);
+  for (size_t i = 0; i < CS_MAX_DEPTH; ++i) {
+    ser_put_u64(w, sketch->seeds[i].seed_main);
+    ser_put_u64(w, sketch->seeds[i].seed_sign);
+  }
+  std::vector<HeapElement> top = sketch->heap->getTopK();
+  ser_put_u64(w, top.size());
+  for (const HeapElement& e : top) {
+    ser_put_u64(w, e.item);
+    ser_put_u64(w, e.count);
+  }
+  ser_pad(w, SER_PAGE);
+  ser_put_counters(w, sketch->slots, sketch->depth * sketch->width, (u64)sketch->counters);
+  return w->ok;
+}
+
+CountSketch* cs_load(SerReader* r) {
+  CountSketch* cs = (CountSketch*) malloc(sizeof(CountSketch));
+  if (!cs) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  cs->k = ser_get_u64(r);
+  u64 hash_mode = ser_get_u64(r);
+  u64 counters = ser_get_u64(r);
+  u64 overflow = ser_get_u64(r);
+  cs->depth = ser_get_u64(r);
+  cs->width = ser_get_u64(r);
+  for (size_t i = 0; i < CS_MAX_DEPTH; ++i) {
+    cs->seeds[i].seed_main = ser_get_u64(r);
+    cs->seeds[i].seed_sign = ser_get_u64(r);
+  }
+  u64 heap_items = ser_get_u64(r);
+
+  u64 width = cs->width;
+  if (!r->ok || hash_mode > (u64)HashMode::SLICED ||
+      (counters != 2 && counters != 4 && counters != 8) ||
+      overflow > (u64)CounterOverflow::SATURATE || cs->depth == 0 ||
+      cs->depth > CS_MAX_DEPTH || width == 0 || width > r->size ||
+      cs->k > UINT32_MAX || heap_items > cs->k) {
+    free(cs);
+    return NULL;
+  }
+  std::vector<HeapElement> top(heap_items);
+  for (u64 i = 0; i < heap_items; ++i) {
+    top[i].item = ser_get_u64(r);
+    top[i].count = ser_get_u64(r);
+  }
+
+  cs->hash_mode = (HashMode)hash_mode;
+  cs->counters = (CounterWidth)counters;
+  cs->overflow = (CounterOverflow)overflow;
+  cs->width_mask = (width & (width - 1)) == 0 ? width - 1 : 0;
+  cs->kernels = cs_pick_kernels(cs->counters, cs->depth, width);
+  bool mapped;
+  cs->slots = ser_get_counters(r, cs->depth * width, counters, SER_PAGE, &mapped);
+  cs->slots_mem = mapped ? TableMem::MMAP : TableMem::HEAP;
+  cs->alloc = TableAlloc();
+  if (!cs->slots) {
+    free(cs);
+    return NULL;
+  }
+  cs->heap = new MinHeap(cs->k);
+  for (const HeapElement& e : top) cs->heap->insertOrUpdate(e.item, e.count);
+  return cs;
+}
+
+u64 cs_table_size(const CountSketch* sketch) {
+  return sizeof(CountSketch) + table_resident(sketch->slots, cs_slots_bytes(sketch));
+}
+
 u64 cs_size(CountSketch* sketch) {
-  u64 base = sizeof(CountSketch);
+  u64 base = cs_table_size(sketch);
   printf("Size of Sketch without heap: %ld\n", base);
   base += sketch->heap->size();
   return base;
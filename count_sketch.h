@@ -1,4 +1,8 @@
+#include "counter.h"
 #include "min_heap.h"
+#include "row_hash.h"
+#include "serialize.h"
+#include "table_alloc.h"
 #include <stdint.h>
 #include <unordered_map>
 #include <vector>
@@ -8,6 +12,7 @@
 
 #define START_SEED 42069
 
+// Default dimensions, used when cs_init is not given any.
 #ifndef NUM_HASH_FUNCTION_PAIRS
 #define NUM_HASH_FUNCTION_PAIRS 5 // Must be odd for easy median calculation
 #endif
@@ -16,6 +21,10 @@
 #define CS_NUM_BUCKETS 2048 // Must be a power of two
 #endif
 
+#ifndef CS_MAX_DEPTH
+#define CS_MAX_DEPTH 31 // Upper bound on rows for runtime sized sketches
+#endif
+
 #define u64 uint64_t
 #define i64 int64_t
 
@@ -26,25 +35,92 @@ typedef struct {
   u64 seed_sign;
 } HashPair;
 
+struct CountSketch;
+
+// Update/query kernels compiled for one (counter width, depth, width), see
+// CmsKernels.
 typedef struct {
-  HashPair seeds[NUM_HASH_FUNCTION_PAIRS];
+  CounterWidth counters;
+  u64 depth; // 0 for the runtime sized kernels
+  u64 width;
+  bool (*add)(CountSketch* sketch, u64 item, i64 delta);
+  u64 (*estimate)(CountSketch* sketch, u64 item);
+} CsKernels;
+
+typedef struct CountSketch {
+  HashPair seeds[CS_MAX_DEPTH];
   u64 k;
-  i64 slots[NUM_HASH_FUNCTION_PAIRS][CS_NUM_BUCKETS];
+  HashMode hash_mode;
+  u64 depth; // rows
+  u64 width; // buckets per row
+  u64 width_mask; // width - 1 when width is a power of two, else 0
+  CounterWidth counters; // signed counters of this width, only grows under PROMOTE
+  CounterOverflow overflow;
+  void* slots; // depth rows of width counters, one 64 byte aligned allocation
+  TableMem slots_mem; // how slots was obtained, a file mapping after cs_load
+  TableAlloc alloc; // placement of slots, kept for cs_init_like and promotion
+  const CsKernels* kernels;
   MinHeap* heap;
 } CountSketch;
 
-CountSketch* cs_init(u64 N, double phi);
+CountSketch* cs_init(u64 N, double phi, HashMode hash_mode = HashMode::PER_ROW,
+                     u64 width = CS_NUM_BUCKETS, u64 depth = NUM_HASH_FUNCTION_PAIRS,
+                     CounterWidth counters = CounterWidth::BITS64,
+                     CounterOverflow overflow = CounterOverflow::PROMOTE,
+                     u64 seed = START_SEED, const TableAlloc& alloc = TableAlloc());
+
+// Empty sketch with the same seeds, dimensions, k and hash mode as other, so
+// the two can be merged.
+CountSketch* cs_init_like(const CountSketch* other);
 
-bool cs_add(CountSketch* sketch, u64 item);
+// Counts weight occurrences of item (at most INT64_MAX) in one update.
+bool cs_add(CountSketch* sketch, u64 item, u64 weight = 1);
+
+// Signed update, a negative delta takes earlier occurrences back. The heap
+// lowers the item's count but keeps the item.
+bool cs_update(CountSketch* sketch, u64 item, i64 delta);
 
 u64 cs_estimate(CountSketch* sketch, u64 item);
 
 // MisraGries* mg_get_topk(MisraGries* sketch);
 
+// Widens every counter to the given width and switches to its kernels.
+void cs_promote(CountSketch* sketch, CounterWidth counters);
+
+// True when a and b send every item to the same counters with the same signs
+// (seeds, dimensions and hash mode match), so their tables can be combined.
+bool cs_compatible(const CountSketch* a, const CountSketch* b);
+
+// Adds src's counters into dst. The two must be cs_compatible, their counter
+// widths may differ (dst is promoted to fit). The heap of dst is left
+// untouched.
+void cs_merge_slots(CountSketch* dst, const CountSketch* src);
+
+// Subtracts src's counters from dst.
+void cs_subtract_slots(CountSketch* dst, const CountSketch* src);
+
+// Slot merge/subtract plus a heap rebuilt from both heaps' items, see
+// cms_merge. False, with dst untouched, if the sketches are not compatible.
+bool cs_merge(CountSketch* dst, const CountSketch* src);
+bool cs_subtract(CountSketch* dst, const CountSketch* src);
+
+// Zeroes the counters and empties the heap.
+void cs_clear(CountSketch* sketch);
+
 void cs_free(CountSketch* sketch);
 
+// Writes the parameters, seeds, heap items and counter table, see serialize.h.
+bool cs_serialize(const CountSketch* sketch, SerWriter* w);
+
+// Reads a sketch written by cs_serialize, mapping the counter table and
+// rebuilding the heap, see cms_load. Returns NULL on a malformed file.
+CountSketch* cs_load(SerReader* r);
+
 // void mg_print_sketch_table(MisraGries* sketch);
 
+// Struct and resident counter table bytes, the heap left out.
+u64 cs_table_size(const CountSketch* sketch);
+
 u64 cs_size(CountSketch* sketch);
 
 #endif
@@ -0,0 +1,102 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <type_traits>
+
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+// Width of the CMS/CS counter tables. CMS uses unsigned counters, CS signed
+// ones of the same width.
+enum class CounterWidth {
+  BITS16 = 2,
+  BITS32 = 4,
+  BITS64 = 8,
+};
+
+// What happens when a counter would leave its range.
+enum class CounterOverflow {
+  PROMOTE,  // widen the whole table to the next width and carry on
+  SATURATE, // pin the counter at its limit
+};
+
+// Next wider width, BITS64 stays.
+static inline CounterWidth counter_wider(CounterWidth width) {
+  return width == CounterWidth::BITS16 ? CounterWidth::BITS32 : CounterWidth::BITS64;
+}
+
+// Whether adding delta to v would pass T's maximum, or for signed T its
+// minimum. Unsigned counters stop at zero instead, see counter_add.
+template <typename T>
+static inline bool counter_overflows(T v, int64_t delta) {
+  if (sizeof(T) == 8) return false; // never in practice, keep u64 updates branch free
+  int64_t r = (int64_t)v + delta;
+  return r > (int64_t)std::numeric_limits<T>::max() ||
+         (std::is_signed<T>::value && r < (int64_t)std::numeric_limits<T>::min());
+}
+
+// *slot += delta, unsigned counters stop at zero. A result that overflows
+// (see counter_overflows) returns false with *slot untouched under PROMOTE
+// and is clamped under SATURATE.
+template <typename T>
+static inline bool counter_add(T* slot, int64_t delta, CounterOverflow overflow) {
+  if (sizeof(T) == 8) {
+    if (std::is_unsigned<T>::value && delta < 0 && *slot < (T)(0 - (uint64_t)delta)) *slot = 0;
+    else *slot += delta;
+    return true;
+  }
+  const int64_t lo = std::numeric_limits<T>::min();
+  const int64_t hi = std::numeric_limits<T>::max();
+  int64_t v = (int64_t)*slot + delta;
+  if (overflow == CounterOverflow::PROMOTE && counter_overflows<T>(*slot, delta)) return false;
+  *slot = (T)(v < lo ? lo : (v > hi ? hi : v));
+  return true;
+}
+
+// Copies cells counters of type From into a table of the wider type To.
+template <typename From, typename To>
+static inline void counter_widen(const void* src, void* dst, size_t cells) {
+  const From* s = (const From*)src;
+  To* d = (To*)dst;
+  for (size_t i = 0; i < cells; ++i) d[i] = s[i];
+}
+
+// dst[i] += src[i] (or -= when subtract) for cells counters, To at least as
+// wide as From. Unsigned counters stop at zero. Under PROMOTE returns false,
+// leaving dst untouched, when a result does not fit To; under SATURATE such
+// results are clamped. Branch free so the loops vectorize.
+template <typename To, typename From>
+static inline bool counter_merge(void* dst, const void* src, size_t cells,
+                                 CounterOverflow overflow, bool subtract = false) {
+  To* d = (To*)dst;
+  const From* s = (const From*)src;
+  if (sizeof(To) == 8) {
+    if (!subtract) {
+      for (size_t i = 0; i < cells; ++i) d[i] += s[i];
+    } else if (std::is_signed<To>::value) {
+      for (size_t i = 0; i < cells; ++i) d[i] -= s[i];
+    } else {
+      for (size_t i = 0; i < cells; ++i) d[i] = d[i] > (To)s[i] ? d[i] - s[i] : 0;
+    }
+    return true;
+  }
+  const int64_t lo = std::numeric_limits<To>::min();
+  const int64_t hi = std::numeric_limits<To>::max();
+  const int64_t sign = subtract ? -1 : 1;
+  if (overflow == CounterOverflow::PROMOTE) {
+    // A wider unsigned table would not help below zero, those just clamp.
+    bool fits = true;
+    for (size_t i = 0; i < cells; ++i) {
+      int64_t v = (int64_t)d[i] + sign * (int64_t)s[i];
+      fits &= v <= hi && (std::is_unsigned<To>::value || v >= lo);
+    }
+    if (!fits) return false;
+  }
+  for (size_t i = 0; i < cells; ++i) {
+    int64_t v = (int64_t)d[i] + sign * (int64_t)s[i];
+    d[i] = (To)(v < lo ? lo : (v > hi ? hi : v));
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,312 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "dyadic_sketch.h"
+#include "hashutil.h"
+#include "row_hash.h"
+
+#define ZETA_1_5 2.6123
+#define DCMS_MAX_DEPTH 32
+
+static inline u64 dcms_prefix(u64 item, u64 level) {
+  return level >= 64 ? 0 : item >> level;
+}
+
+// Prefixes at a level, saturated at 2^64 - 1 for the full 64 bit space.
+static inline u64 dcms_prefixes(u64 bits, u64 level) {
+  return bits - level >= 64 ? UINT64_MAX : 1ULL << (bits - level);
+}
+
+static inline u64 dcms_bucket(const DyadicSketch* sketch, u64 h) {
+  return sketch->width_mask ? h & sketch->width_mask : h % sketch->width;
+}
+
+// Row i of a sketched level sits at i * width + dcms_bucket(h1 + i * h2).
+static inline void dcms_hash(const DyadicSketch* sketch, u64 level, u64 prefix, u64* h1,
+                             u64* h2) {
+  u64 h = MurmurHash64A(&prefix, sizeof(u64), sketch->seeds[level]);
+  *h1 = h;
+  *h2 = ((h >> 32) | (h << 32)) | 1;
+}
+
+// Lays the levels out in sketch->levels, given bits, depth and width. Does
+// not allocate, levels[l] are offsets until dcms_place.
+static void dcms_shape(DyadicSketch* sketch) {
+  u64 sketched = sketch->depth * sketch->width;
+  sketch->exact_from = sketch->bits + 1;
+  u64 cells = 0;
+  for (u64 l = 0; l <= sketch->bits; ++l) {
+    u64 prefixes = dcms_prefixes(sketch->bits, l);
+    if (sketch->exact_from > sketch->bits && prefixes <= sketched) sketch->exact_from = l;
+    sketch->levels[l] = (u64*)(uintptr_t)cells;
+    cells += l >= sketch->exact_from ? prefixes : sketched;
+  }
+  sketch->cells = cells;
+}
+
+static void dcms_place(DyadicSketch* sketch, u64* table) {
+  for (u64 l = 0; l <= sketch->bits; ++l)
+    sketch->levels[l] = table + (uintptr_t)sketch->levels[l];
+}
+
+static void dcms_seed(DyadicSketch* sketch) {
+  u64 state = sketch->seed;
+  for (u64 l = 0; l <= DCMS_MAX_BITS; ++l) sketch->seeds[l] = row_hash_next_seed(&state);
+}
+
+static u64* dcms_alloc_table(DyadicSketch* sketch) {
+  return (u64*)table_alloc(sketch->cells * sizeof(u64), sketch->alloc, &sketch->mem);
+}
+
+DyadicSketch* dcms_init(u64 N, double phi, u64 width, u64 depth, u64 bits, u64 seed,
+                        const TableAlloc& alloc) {
+  if (phi == 0.0) {
+    fprintf(stderr, "Phi value can not be zero");
+    exit(1);
+  }
+  if (depth == 0 || depth > DCMS_MAX_DEPTH || width == 0 || width > UINT32_MAX || bits == 0 ||
+      bits > DCMS_MAX_BITS) {
+    fprintf(stderr, "Invalid dyadic sketch dimensions %ld x %ld over %ld bits\n", depth, width,
+            bits);
+    exit(1);
+  }
+  DyadicSketch* sketch = (DyadicSketch*)malloc(sizeof(DyadicSketch));
+  if (!sketch) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  // Same k as the CMS heap, see cms_init.
+  sketch->k = (u64) floor(pow(1.0 / (phi * ZETA_1_5), 2.0/3.0));
+  printf("estimated k: %ld\n", sketch->k);
+  sketch->bits = bits;
+  sketch->depth = depth;
+  sketch->width = width;
+  sketch->width_mask = (width & (width - 1)) == 0 ? width - 1 : 0;
+  sketch->seed = seed;
+  dcms_seed(sketch);
+  dcms_shape(sketch);
+  sketch->alloc = alloc;
+  dcms_place(sketch, dcms_alloc_table(sketch));
+  return sketch;
+}
+
+DyadicSketch* dcms_init_like(const DyadicSketch* other) {
+  DyadicSketch* sketch = (DyadicSketch*)malloc(sizeof(DyadicSketch));
+  if (!sketch) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  memcpy(sketch, other, sizeof(DyadicSketch));
+  dcms_shape(sketch);
+  dcms_place(sketch, dcms_alloc_table(sketch));
+  return sketch;
+}
+
+bool dcms_add(DyadicSketch* sketch, u64 item, u64 weight) {
+  if (!dcms_fits(sketch, item)) return false;
+  for (u64 l = 0; l <= sketch->bits; ++l) {
+    u64 prefix = dcms_prefix(item, l);
+    u64* level = sketch->levels[l];
+    if (l >= sketch->exact_from) {
+      level[prefix] += weight;
+      continue;
+    }
+    u64 h1, h2;
+    dcms_hash(sketch, l, prefix, &h1, &h2);
+    for (u64 i = 0; i < sketch->depth; ++i)
+      level[i * sketch->width + dcms_bucket(sketch, h1 + i * h2)] += weight;
+  }
+  return true;
+}
+
+bool dcms_add_batch(DyadicSketch* sketch, const u64* items, size_t n, const u64* weights) {
+  bool ok = true;
+  uint32_t index[DCMS_MAX_DEPTH][DCMS_BATCH];
+  u64 w[DCMS_BATCH], it[DCMS_BATCH];
+  for (size_t start = 0; start < n; start += DCMS_BATCH) {
+    size_t m = 0;
+    for (size_t j = start; j < n && j < start + DCMS_BATCH; ++j) {
+      if (!dcms_fits(sketch, items[j])) {
+        ok = false;
+        continue;
+      }
+      it[m] = items[j];
+      w[m++] = weights ? weights[j] : 1;
+    }
+    for (u64 l = 0; l <= sketch->bits; ++l) {
+      u64* level = sketch->levels[l];
+      if (l >= sketch->exact_from) {
+        for (size_t j = 0; j < m; ++j) level[dcms_prefix(it[j], l)] += w[j];
+        continue;
+      }
+      // Hash every item's prefix and prefetch its counters before the first
+      // increment, so the misses of one level are in flight together.
+      for (size_t j = 0; j < m; ++j) {
+        u64 h1, h2;
+        dcms_hash(sketch, l, dcms_prefix(it[j], l), &h1, &h2);
+        for (u64 i = 0; i < sketch->depth; ++i) {
+          index[i][j] = (uint32_t)dcms_bucket(sketch, h1 + i * h2);
+          __builtin_prefetch(level + i * sketch->width + index[i][j], 1);
+        }
+      }
+      for (u64 i = 0; i < sketch->depth; ++i) {
+        u64* row = level + i * sketch->width;
+        for (size_t j = 0; j < m; ++j) row[index[i][j]] += w[j];
+      }
+    }
+  }
+  return ok;
+}
+
+// Count of one prefix at one level.
+static u64 dcms_level_estimate(const DyadicSketch* sketch, u64 level, u64 prefix) {
+  const u64* table = sketch->levels[level];
+  if (level >= sketch->exact_from) return table[prefix];
+  u64 h1, h2;
+  dcms_hash(sketch, level, prefix, &h1, &h2);
+  u64 est = UINT64_MAX;
+  for (u64 i = 0; i < sketch->depth; ++i)
+    est = std::min(est, table[i * sketch->width + dcms_bucket(sketch, h1 + i * h2)]);
+  return est;
+}
+
+u64 dcms_estimate(const DyadicSketch* sketch, u64 item) {
+  if (!dcms_fits(sketch, item)) return 0;
+  return dcms_level_estimate(sketch, 0, item);
+}
+
+u64 dcms_total(const DyadicSketch* sketch) {
+  return sketch->levels[sketch->bits][0];
+}
+
+u64 dcms_range(const DyadicSketch* sketch, u64 lo, u64 hi) {
+  if (sketch->bits < 64) hi = std::min<u64>(hi, (1ULL << sketch->bits) - 1);
+  if (lo > hi) return 0;
+  u64 sum = 0;
+  // Peel the odd left end and even right end off at each level, what is left
+  // is a whole range of the next level's prefixes.
+  for (u64 l = 0;; ++l) {
+    if (lo == hi) return sum + dcms_level_estimate(sketch, l, lo);
+    if (lo & 1) sum += dcms_level_estimate(sketch, l, lo++);
+    if (!(hi & 1)) sum += dcms_level_estimate(sketch, l, hi--);
+    if (lo > hi) return sum;
+    lo >>= 1;
+    hi >>= 1;
+  }
+}
+
+u64 dcms_quantile(const DyadicSketch* sketch, double q) {
+  double rank = q * dcms_total(sketch);
+  u64 prefix = 0;
+  for (u64 l = sketch->bits; l-- > 0;) {
+    u64 left = prefix << 1;
+    u64 count = dcms_level_estimate(sketch, l, left);
+    if (rank > count) {
+      rank -= count;
+      prefix = left | 1;
+    } else {
+      prefix = left;
+    }
+  }
+  return prefix;
+}
+
+void dcms_heavy_hitters(const DyadicSketch* sketch, double threshold,
+                        std::vector<HeapElement>* out) {
+  // A zero threshold would expand every prefix.
+  if (threshold < 1) threshold = 1;
+  if (dcms_total(sketch) < threshold) return;
+  std::vector<u64> frontier(1, 0), next;
+  for (u64 l = sketch->bits; l-- > 0;) {
+    next.clear();
+    for (u64 prefix : frontier) {
+      for (u64 bit = 0; bit < 2; ++bit) {
+        u64 child = (prefix << 1) | bit;
+        u64 count = dcms_level_estimate(sketch, l, child);
+        if (count < threshold) continue;
+        if (l == 0) out->push_back({child, count});
+        else next.push_back(child);
+      }
+    }
+    frontier.swap(next);
+  }
+}
+
+bool dcms_compatible(const DyadicSketch* a, const DyadicSketch* b) {
+  return a->bits == b->bits && a->depth == b->depth && a->width == b->width &&
+         a->seed == b->seed;
+}
+
+static u64* dcms_table(const DyadicSketch* sketch) {
+  return sketch->levels[0];
+}
+
+bool dcms_merge(DyadicSketch* dst, const DyadicSketch* src) {
+  if (!dcms_compatible(dst, src)) return false;
+  u64* d = dcms_table(dst);
+  const u64* s = dcms_table(src);
+  for (u64 c = 0; c < dst->cells; ++c) d[c] += s[c];
+  return true;
+}
+
+bool dcms_subtract(DyadicSketch* dst, const DyadicSketch* src) {
+  if (!dcms_compatible(dst, src)) return false;
+  u64* d = dcms_table(dst);
+  const u64* s = dcms_table(src);
+  for (u64 c = 0; c < dst->cells; ++c) d[c] -= std::min(d[c], s[c]);
+  return true;
+}
+
+void dcms_free(DyadicSketch* sketch) {
+  table_free(dcms_table(sketch), sketch->cells * sizeof(u64), sketch->mem);
+  free(sketch);
+}
+
+bool dcms_serialize(const DyadicSketch* sketch, SerWriter* w) {
+  ser_put_u64(w, sketch->bits);
+  ser_put_u64(w, sketch->depth);
+  ser_put_u64(w, sketch->width);
+  ser_put_u64(w, sketch->k);
+  ser_put_u64(w, sketch->seed);
+  ser_pad(w, SER_PAGE);
+  ser_put_counters(w, dcms_table(sketch), sketch->cells, sizeof(u64));
+  return w->ok;
+}
+
+DyadicSketch* dcms_load(SerReader* r) {
+  DyadicSketch* sketch = (DyadicSketch*)malloc(sizeof(DyadicSketch));
+  if (!sketch) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  sketch->bits = ser_get_u64(r);
+  sketch->depth = ser_get_u64(r);
+  sketch->width = ser_get_u64(r);
+  sketch->k = ser_get_u64(r);
+  sketch->seed = ser_get_u64(r);
+  if (!r->ok || sketch->bits == 0 || sketch->bits > DCMS_MAX_BITS || sketch->depth == 0 ||
+      sketch->depth > DCMS_MAX_DEPTH || sketch->width == 0 || sketch->width > UINT32_MAX ||
+      sketch->depth * sketch->width > r->size) {
+    free(sketch);
+    return NULL;
+  }
+  sketch->width_mask = (sketch->width & (sketch->width - 1)) == 0 ? sketch->width - 1 : 0;
+  dcms_seed(sketch);
+  dcms_shape(sketch);
+  bool mapped;
+  u64* table = (u64*)ser_get_counters(r, sketch->cells, sizeof(u64), SER_PAGE, &mapped);
+  sketch->mem = mapped ? TableMem::MMAP : TableMem::HEAP;
+  sketch->alloc = TableAlloc();
+  if (!table) {
+    free(sketch);
+    return NULL;
+  }
+  dcms_place(sketch, table);
+  return sketch;
+}
+
+u64 dcms_size(const DyadicSketch* sketch) {
+  return sizeof(DyadicSketch) + table_resident(dcms_table(sketch), sketch->cells * sizeof(u64));
+}
@@ -0,0 +1,109 @@
+#include "min_heap.h"
+#include "serialize.h"
+#include "table_alloc.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef _DYADIC_SKETCH_H_
+#define _DYADIC_SKETCH_H_
+
+#define u64 uint64_t
+#define START_SEED 42069
+
+#ifndef DCMS_MAX_BITS
+#define DCMS_MAX_BITS 64
+#endif
+
+#ifndef DCMS_BATCH
+#define DCMS_BATCH 16 // Items whose level updates dcms_add_batch interleaves
+#endif
+
+// Dyadic Count-Min: level l counts the prefixes item >> l of a bits wide key
+// space, level 0 the items themselves, level bits the whole stream. A range
+// is the sum of at most 2 * bits dyadic blocks, and heavy hitters are found
+// by descending from the top and only expanding prefixes that are heavy
+// themselves, so updates keep no heap.
+//
+// Levels with at most depth * width prefixes are exact arrays, the rest are
+// depth x width Count-Min tables. An update takes one hash per sketched
+// level, its rows come from that hash by double hashing (see row_hash.h).
+typedef struct {
+  u64 bits;   // key width, items must be < 2^bits
+  u64 depth;  // rows of the sketched levels
+  u64 width;  // buckets per row
+  u64 width_mask; // width - 1 when width is a power of two, else 0
+  u64 exact_from; // first level kept as an exact array
+  u64 k;      // heavy hitters reported at most, as for a CMS
+  u64 seed;
+  u64 seeds[DCMS_MAX_BITS + 1]; // hash seed per level
+  u64* levels[DCMS_MAX_BITS + 1]; // counters of every level, one allocation
+  u64 cells;  // counters in the allocation
+  TableMem mem; // how the counters were obtained, a file mapping after dcms_load
+  TableAlloc alloc; // placement of the counters, kept for dcms_init_like
+} DyadicSketch;
+
+DyadicSketch* dcms_init(u64 N, double phi, u64 width, u64 depth, u64 bits = 64,
+                        u64 seed = START_SEED, const TableAlloc& alloc = TableAlloc());
+
+// Empty sketch with the same shape and seeds, so the two can be merged.
+DyadicSketch* dcms_init_like(const DyadicSketch* other);
+
+// True when item is inside the key space, i.e. below 2^bits.
+static inline bool dcms_fits(const DyadicSketch* sketch, u64 item) {
+  return sketch->bits >= 64 || (item >> sketch->bits) == 0;
+}
+
+// Smallest bits that every one of items[0..n) fits in (at least 1).
+static inline u64 dcms_key_bits(const u64* items, size_t n) {
+  u64 all = 1;
+  for (size_t i = 0; i < n; ++i) all |= items[i];
+  return 64 - __builtin_clzll(all);
+}
+
+// Counts weight occurrences of item at every level. False, counting
+// nothing, when item does not fit the key space.
+bool dcms_add(DyadicSketch* sketch, u64 item, u64 weight = 1);
+
+// Same result as dcms_add on each item (false if any was left out), but
+// walks the levels for DCMS_BATCH items at a time: their hashes first, then
+// prefetches, then the increments, so the cache misses of one level overlap.
+bool dcms_add_batch(DyadicSketch* sketch, const u64* items, size_t n,
+                    const u64* weights = NULL);
+
+u64 dcms_estimate(const DyadicSketch* sketch, u64 item);
+
+// Estimated count of the items in [lo, hi], never below the true count.
+u64 dcms_range(const DyadicSketch* sketch, u64 lo, u64 hi);
+
+// Everything counted, exact.
+u64 dcms_total(const DyadicSketch* sketch);
+
+// Smallest x with dcms_range(0, x) >= q * total, by one descent.
+u64 dcms_quantile(const DyadicSketch* sketch, double q);
+
+// Appends every item whose estimate is at least threshold. Only prefixes
+// that reach the threshold are expanded, so this touches about
+// bits * depth * (total / threshold) counters.
+void dcms_heavy_hitters(const DyadicSketch* sketch, double threshold,
+                        std::vector<HeapElement>* out);
+
+// True when a and b share bits, dimensions and seeds.
+bool dcms_compatible(const DyadicSketch* a, const DyadicSketch* b);
+
+// Adds src's counters to dst (subtracts, stopping at zero). False, with dst
+// untouched, if the two are not dcms_compatible.
+bool dcms_merge(DyadicSketch* dst, const DyadicSketch* src);
+bool dcms_subtract(DyadicSketch* dst, const DyadicSketch* src);
+
+void dcms_free(DyadicSketch* sketch);
+
+// Writes the parameters and every level's counters.
+bool dcms_serialize(const DyadicSketch* sketch, SerWriter* w);
+
+// Reads a sketch written by dcms_serialize, NULL on a malformed file.
+DyadicSketch* dcms_load(SerReader* r);
+
+u64 dcms_size(const DyadicSketch* sketch);
+
+#endif
@@ -0,0 +1,279 @@
+#ifndef FLAT_COUNTER_MAP_H
+#define FLAT_COUNTER_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define u64 uint64_t
+
+// Open addressing item -> count table in the SwissTable style: slots come in
+// groups of 16 with one control byte each, which holds 7 bits of the item's
+// hash while the slot is full. A lookup compares the 16 control bytes of a
+// group at once (SSE2) and only reads the keys whose byte matches, probing
+// further groups quadratically until one has an empty slot.
+//
+// Keys and counts are separate arrays, so decrementing every counter and
+// finding the smallest are straight passes over the counts, two counters per
+// SSE4 instruction. Erased slots become tombstones unless their group still
+// has an empty slot; once inserts have used up the empty slots the table is
+// rehashed in place. Everything lives in one arena sized from the capacity,
+// nothing is allocated after construction.
+class FlatCounterMap {
+public:
+    static constexpr size_t NIL = SIZE_MAX;
+    static constexpr size_t GROUP = 16;
+
+private:
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t DELETED = -2;
+
+    int8_t* ctrl;  // EMPTY, DELETED or the low 7 hash bits of a full slot
+    u64* keys;
+    u64* counts;   // 0 in every slot that is not full
+    size_t arenaBytes;
+    size_t slots;
+    size_t groupMask;
+    size_t used;
+    size_t growthLeft; // inserts into empty slots left before a rebuild
+    size_t rebuilds;
+    const size_t cap;
+
+    static u64 hash(u64 item) {
+        // MurmurHash3 finalizer, every output bit depends on every input bit.
+        item ^= item >> 33;
+        item *= 0xff51afd7ed558ccdULL;
+        item ^= item >> 33;
+        item *= 0xc4ceb9fe1a85ec53ULL;
+        item ^= item >> 33;
+        return item;
+    }
+
+    // Bit i set when control byte i of group g equals b.
+    uint32_t match(size_t g, int8_t b) const {
+#ifdef __SSE2__
+        __m128i group = _mm_load_si128((const __m128i*)(ctrl + g * GROUP));
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP; ++i) bits |= (uint32_t)(ctrl[g * GROUP + i] == b) << i;
+        return bits;
+#endif
+    }
+
+    // Empty or deleted slots: the control bytes with the high bit set.
+    uint32_t matchFree(size_t g) const {
+#ifdef __SSE2__
+        return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)(ctrl + g * GROUP)));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP; ++i) bits |= (uint32_t)(ctrl[g * GROUP + i] < 0) << i;
+        return bits;
+#endif
+    }
+
+    // Full slots of group g whose count is 0.
+    uint32_t matchDead(size_t g) const {
+        uint32_t full = ~matchFree(g) & 0xffff;
+        uint32_t zero = 0;
+#ifdef __SSE4_1__
+        const __m128i* n = (const __m128i*)(counts + g * GROUP);
+        for (size_t i = 0; i < GROUP / 2; ++i) {
+            __m128i z = _mm_cmpeq_epi64(_mm_load_si128(n + i), _mm_setzero_si128());
+            zero |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(z)) << (2 * i);
+        }
+#else
+        for (size_t i = 0; i < GROUP; ++i) zero |= (uint32_t)(counts[g * GROUP + i] == 0) << i;
+#endif
+        return full & zero;
+    }
+
+    // First empty or deleted slot on h's probe sequence.
+    size_t freeSlot(u64 h) const {
+        size_t g = (h >> 7) & groupMask;
+        for (size_t step = 1;; ++step) {
+            uint32_t m = matchFree(g);
+            if (m) return g * GROUP + __builtin_ctz(m);
+            g = (g + step) & groupMask;
+        }
+    }
+
+    void place(u64 h, u64 item, u64 count) {
+        size_t s = freeSlot(h);
+        growthLeft -= ctrl[s] == EMPTY;
+        ctrl[s] = (int8_t)(h & 0x7f);
+        keys[s] = item;
+        counts[s] = count;
+        used++;
+    }
+
+    // Drops the tombstones without a second table: every live entry is
+    // marked DELETED, tombstones become EMPTY, then each marked entry moves to
+    // the first free slot of its probe sequence, swapping with a marked entry
+    // that still has to be placed, or stays when that is its own group.
+    void rebuild() {
+        for (size_t s = 0; s < slots; ++s) ctrl[s] = ctrl[s] >= 0 ? DELETED : EMPTY;
+        for (size_t s = 0; s < slots; ++s) {
+            if (ctrl[s] != DELETED) continue;
+            u64 h = hash(keys[s]);
+            int8_t h2 = (int8_t)(h & 0x7f);
+            size_t t = freeSlot(h);
+            if (t / GROUP == s / GROUP) {
+                ctrl[s] = h2;
+                continue;
+            }
+            bool empty = ctrl[t] == EMPTY;
+            ctrl[t] = h2;
+            if (empty) {
+                keys[t] = keys[s];
+                counts[t] = counts[s];
+                ctrl[s] = EMPTY;
+                counts[s] = 0;
+                continue;
+            }
+            std::swap(keys[s], keys[t]);
+            std::swap(counts[s], counts[t]);
+            --s; // the entry swapped in still has to be placed
+        }
+        growthLeft = slots - slots / 8 - used;
+        rebuilds++;
+    }
+
+public:
+    FlatCounterMap(size_t capacity) : rebuilds(0), cap(capacity) {
+        // At most 7/8 of the slots are ever taken, so every probe meets an
+        // empty slot.
+        slots = GROUP;
+        while (slots - slots / 8 < cap) slots <<= 1;
+        groupMask = slots / GROUP - 1;
+
+        size_t ctrlBytes = slots;
+        size_t wordBytes = slots * sizeof(u64);
+        arenaBytes = (ctrlBytes + 2 * wordBytes + 63) & ~(size_t)63;
+        char* arena = (char*)aligned_alloc(64, arenaBytes);
+        if (!arena) {
+            fprintf(stderr, "Unable to allocate memory for sketch\n");
+            exit(1);
+        }
+        ctrl = (int8_t*)arena;
+        keys = (u64*)(arena + ctrlBytes);
+        counts = (u64*)(arena + ctrlBytes + wordBytes);
+        clear();
+    }
+
+    ~FlatCounterMap() {
+        free(ctrl);
+    }
+
+    FlatCounterMap(const FlatCounterMap&) = delete;
+    FlatCounterMap& operator=(const FlatCounterMap&) = delete;
+
+    void clear() {
+        memset(ctrl, EMPTY, slots);
+        memset(counts, 0, slots * sizeof(u64));
+        used = 0;
+        growthLeft = slots - slots / 8;
+    }
+
+    // Slot of item, or NIL.
+    size_t find(u64 item) const {
+        u64 h = hash(item);
+        int8_t h2 = (int8_t)(h & 0x7f);
+        size_t g = (h >> 7) & groupMask;
+        for (size_t step = 1;; ++step) {
+            for (uint32_t m = match(g, h2); m; m &= m - 1) {
+                size_t s = g * GROUP + __builtin_ctz(m);
+                if (keys[s] == item) return s;
+            }
+            if (match(g, EMPTY)) return NIL;
+            g = (g + step) & groupMask;
+        }
+    }
+
+    // Adds an absent item, there must be room (full() == false).
+    void insert(u64 item, u64 count) {
+        u64 h = hash(item);
+        if (growthLeft == 0 && ctrl[freeSlot(h)] == EMPTY) rebuild();
+        place(h, item, count);
+    }
+
+    u64 item(size_t slot) const { return keys[slot]; }
+    u64 count(size_t slot) const { return counts[slot]; }
+    void increment(size_t slot, u64 delta) { counts[slot] += delta; }
+
+    // Smallest count, only valid when not empty.
+    u64 minCount() const {
+#ifdef __SSE4_2__
+        // cmpgt is signed, flipping the top bit of both sides makes it an
+        // unsigned compare.
+        const __m128i top = _mm_set1_epi64x(-1), zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi64x(INT64_MIN);
+        __m128i best = top;
+        for (size_t s = 0; s < slots; s += 2) {
+            __m128i c = _mm_load_si128((const __m128i*)(counts + s));
+            c = _mm_blendv_epi8(c, top, _mm_cmpeq_epi64(c, zero));
+            __m128i gt = _mm_cmpgt_epi64(_mm_xor_si128(best, bias), _mm_xor_si128(c, bias));
+            best = _mm_blendv_epi8(best, c, gt);
+        }
+        u64 lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, best);
+        return lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+#else
+        u64 min = UINT64_MAX;
+        for (size_t s = 0; s < slots; ++s) {
+            u64 c = counts[s] ? counts[s] : UINT64_MAX;
+            min = c < min ? c : min;
+        }
+        return min;
+#endif
+    }
+
+    // Takes cut (at most minCount()) off every counter and frees the slots
+    // that reach zero. Returns how many were freed.
+    size_t decrementAll(u64 cut) {
+        // Live counts are >= cut, the others stay 0 (vectorized by the compiler).
+        u64* n = counts;
+        for (size_t s = 0, len = slots; s < len; ++s) n[s] = n[s] ? n[s] - cut : 0;
+        size_t freed = 0;
+        for (size_t g = 0; g <= groupMask; ++g) {
+            uint32_t dead = matchDead(g);
+            if (!dead) continue;
+            // No probe goes past a group that still has an empty slot, so
+            // its slots can become empty again instead of tombstones.
+            bool open = match(g, EMPTY) != 0;
+            size_t k = __builtin_popcount(dead);
+            freed += k;
+            if (open) growthLeft += k;
+            for (int8_t mark = open ? EMPTY : DELETED; dead; dead &= dead - 1)
+                ctrl[g * GROUP + __builtin_ctz(dead)] = mark;
+        }
+        used -= freed;
+        return freed;
+    }
+
+    // Calls fn(item, count) for every entry, in slot order.
+    template <typename F>
+    void forEach(F fn) const {
+        for (size_t s = 0; s < slots; ++s)
+            if (ctrl[s] >= 0) fn(keys[s], counts[s]);
+    }
+
+    bool empty() const { return used == 0; }
+    bool full() const { return used == cap; }
+    size_t entries() const { return used; }
+    size_t capacity() const { return cap; }
+    // In place rebuilds that cleared tombstones.
+    size_t rebuildCount() const { return rebuilds; }
+
+    size_t size() const {
+        return sizeof(*this) + arenaBytes;
+    }
+};
+
+#endif // FLAT_COUNTER_MAP_H
@@ -1,5 +1,7 @@
 import subprocess
 import re
+import json
+import csv
 import matplotlib.pyplot as plt
 from matplotlib.ticker import MultipleLocator
 import numpy as np
@@ -8,12 +10,20 @@ import os
 
 # Configuration
 PROGRAM_PATH = './test'
+BENCH_PATH = './bench'
+BENCH_OUT = 'bench_results.json'
 MAKE_CMD = 'make -B'
 PHI_MEMORY_TEST = 0.001
 N_MEMORY_TEST = 100_000_000
 MEM_TEST_BUCKETS = [512, 1024, 2048, 4096, 8192]
+# Conservative update stays accurate at much narrower widths
+MEM_TEST_BUCKETS_CU = [128, 256] + MEM_TEST_BUCKETS
 DEFAULT_PHIS = [round(0.001 + i/1000, 3) for i in range(10)]
-COLORS = {'cms': 'blue', 'cs': 'orange', 'mg': 'green'}
+# Row vs cache line blocked CMS, from L1 resident to far beyond L2
+LAYOUT_TEST_BUCKETS = [2048, 65536, 1048576]
+# Pre-aggregation buffer slots, see AGG_SLOTS
+AGG_SLOTS = 512
+COLORS = {'cms': 'blue', 'cms-cu': 'cyan', 'cms-blocked': 'navy', 'cs': 'orange', 'mg': 'green', 'ss': 'purple'}
 
 def run_command(cmd, cwd=None):
     """Run a shell command and return output"""
@@ -40,37 +50,121 @@ def parse_output(output):
     }
     return metrics
 
-def run_phi_experiment(sketch_type, phi_values, n=N_MEMORY_TEST):
+# Columns of the bench CSV that stay strings, every other one is a number.
+BENCH_STRING_COLUMNS = ('sketch', 'alloc', 'dispatch')
+
+def load_bench(path):
+    """Read the runs written by ./bench, JSON or CSV by file extension"""
+    with open(path) as f:
+        if path.endswith('.csv'):
+            rows = list(csv.DictReader(f))
+            for row in rows:
+                for key, value in row.items():
+                    if key not in BENCH_STRING_COLUMNS:
+                        row[key] = float(value)
+            return rows
+        return json.load(f)
+
+def run_bench(sketches, phis=None, n=N_MEMORY_TEST, widths=None, depths=None,
+              threads=None, exps=None, out=BENCH_OUT):
+    """Sweep every combination in one ./bench process and return its runs"""
+    cmd = [BENCH_PATH, f"--sketch={','.join(sketches)}", f"--n={n}", f"--out={out}"]
+    for flag, values in [('phi', phis), ('width', widths), ('depth', depths),
+                         ('threads', threads), ('exp', exps)]:
+        if values:
+            cmd.append(f"--{flag}={','.join(str(v) for v in values)}")
+    if run_command(cmd) is None:
+        return []
+    return load_bench(out)
+
+def run_phi_experiment(sketch_types, phi_values, n=N_MEMORY_TEST):
     """Run phi sensitivity experiments"""
+    return run_bench(sketch_types, phis=phi_values, n=n)
+
+def run_agg_experiment(sketch_type, phi_values, n=N_MEMORY_TEST):
+    """Throughput gain of the pre-aggregation buffer at each phi"""
     results = []
     for phi in phi_values:
-        cmd = [PROGRAM_PATH, str(n), str(phi), sketch_type]
+        cmd = [PROGRAM_PATH, str(n), str(phi), sketch_type, f"--agg={AGG_SLOTS}"]
         output = run_command(cmd)
         if output:
             metrics = parse_output(output)
+            metrics['agg_speedup'] = float(re.search(r'Aggregation buffer speedup: (\d+\.?\d*)', output).group(1))
             metrics.update({'phi': phi, 'sketch': sketch_type})
             results.append(metrics)
     return results
 
+def plot_agg_speedup(data):
+    """Plot the pre-aggregation buffer speedup vs phi"""
+    plt.figure(figsize=(10, 6))
+    for sketch in ['cms', 'cs', 'mg', 'ss']:
+        points = [d for d in data if d['sketch'] == sketch]
+        if not points:
+            continue
+        plt.plot([p['phi'] for p in points], [p['agg_speedup'] for p in points],
+                 marker='o', linestyle='-', color=COLORS[sketch], label=sketch.upper())
+    plt.xlabel('Phi')
+    plt.ylabel('Speedup (x)')
+    plt.title(f'Pre-aggregation Buffer ({AGG_SLOTS} slots) Speedup vs Phi')
+    plt.legend()
+    plt.grid(True)
+
+    timestamp = datetime.now().strftime("%Y%m%d_%H%M%S")
+    plt.savefig(f"agg_speedup_{timestamp}.png")
+    plt.close()
+
+def plot_latency_percentiles(data):
+    """Plot sampled p50/p99/p999 update latency per sketch"""
+    plt.figure(figsize=(10, 6))
+    sketches = sorted({d['sketch'] for d in data})
+    x = np.arange(len(sketches))
+    for i, (key, label) in enumerate([('p50_ns', 'p50'), ('p99_ns', 'p99'), ('p999_ns', 'p99.9')]):
+        values = [np.mean([d[key] for d in data if d['sketch'] == s]) for s in sketches]
+        plt.bar(x + (i - 1) * 0.25, values, 0.25, label=label)
+    plt.xticks(x, [s.upper() for s in sketches])
+    plt.ylabel('Update latency (ns)')
+    plt.title('Sampled Update Latency Percentiles')
+    plt.legend()
+    plt.grid(True, axis='y')
+
+    timestamp = datetime.now().strftime("%Y%m%d_%H%M%S")
+    plt.savefig(f"latency_percentiles_{timestamp}.png")
+    plt.close()
+
 def run_memory_test(sketch_type, bucket_sizes):
-    """Run memory vs accuracy tests with recompilation"""
+    """Run memory vs accuracy tests. CMS/CS are sized at runtime with --width,
+    MG/SS still need a recompile per MULT_FACTOR."""
     results = []
     for buckets in bucket_sizes:
-        if sketch_type == 'cms':
-            copt = f"-DNUM_BUCKETS={buckets}"
-        elif sketch_type == 'cs':
-            copt = f"-DCS_NUM_BUCKETS={buckets}"
+        extra_args = []
+        program_type = sketch_type
+        if sketch_type in ('cms', 'cs'):
+            extra_args = [f"--width={buckets}"]
+            copt = None
+        elif sketch_type == 'cms-cu':
+            # Conservative update Count-Min
+            program_type = 'cms'
+            extra_args = [f"--width={buckets}", "--conservative"]
+            copt = None
+        elif sketch_type == 'cms-blocked':
+            # Cache line blocked Count-Min
+            program_type = 'cms'
+            extra_args = [f"--width={buckets}", "--layout=blocked"]
+            copt = None
         elif sketch_type == 'mg':
             copt = f"-DMG_MULT_FACTOR={buckets}"
+        elif sketch_type == 'ss':
+            copt = f"-DSS_MULT_FACTOR={buckets}"
         else:
             print(f"Unknown sketch type {sketch_type}")
             return results
 
-        compile_cmd = f"{MAKE_CMD} COPT=\"{copt}\""
-        run_command(compile_cmd.split(), cwd=os.path.dirname(PROGRAM_PATH))
+        if copt is not None:
+            compile_cmd = f"{MAKE_CMD} COPT=\"{copt}\""
+            run_command(compile_cmd.split(), cwd=os.path.dirname(PROGRAM_PATH))
 
         # Run test
-        cmd = [PROGRAM_PATH, str(N_MEMORY_TEST), str(PHI_MEMORY_TEST), sketch_type]
+        cmd = [PROGRAM_PATH, str(N_MEMORY_TEST), str(PHI_MEMORY_TEST), program_type] + extra_args
         output = run_command(cmd)
         if output:
             metrics = parse_output(output)
@@ -80,6 +174,9 @@ def run_memory_test(sketch_type, bucket_sizes):
                 'phi': PHI_MEMORY_TEST
             })
             results.append(metrics)
+    # Leave a binary with the default MULT_FACTORs behind
+    if sketch_type in ('mg', 'ss'):
+        run_command(MAKE_CMD.split(), cwd=os.path.dirname(PROGRAM_PATH))
     return results
 
 def plot_metrics(data, x_metric, y_metrics, title, filename):
@@ -120,7 +217,7 @@ def plot_time_analysis(data, count_time):
                 label='Baseline Count Time')
 
     # Plot streaming times
-    for sketch in ['cms', 'cs', 'mg']:
+    for sketch in ['cms', 'cms-cu', 'cms-blocked', 'cs', 'mg', 'ss']:
         sketch_data = [d for d in data if d['sketch'] == sketch]
         if not sketch_data:
             continue
@@ -211,24 +308,27 @@ def plot_additional_analysis(data):
         plt.close()
 
 def main():
-    phi_results = []
-    for st in ['mg', 'cms', 'cs']:
-        phi_results.extend(run_phi_experiment(st, DEFAULT_PHIS))
+    phi_results = run_phi_experiment(['mg', 'cms', 'cs', 'ss'], DEFAULT_PHIS)
 
     print(phi_results)
     plot_metrics(phi_results, 'phi',
                 [('precision', 'Precision'), ('recall', 'Recall')],
                 'Precision/Recall vs Phi',
                 'phi_sensitivity')
+    plot_latency_percentiles(phi_results)
 
     memory_results = []
 
     memory_results.extend(run_memory_test('cms', MEM_TEST_BUCKETS))
 
+    memory_results.extend(run_memory_test('cms-cu', MEM_TEST_BUCKETS_CU))
+
     memory_results.extend(run_memory_test('cs', MEM_TEST_BUCKETS))
 
     memory_results.extend(run_memory_test('mg', [50, 100, 200, 400]))
 
+    memory_results.extend(run_memory_test('ss', [50, 100, 200, 400]))
+
     plot_metrics(memory_results, 'sketch_size',
                 [('precision', 'Precision'), ('recall', 'Recall')],
                 'Precision/Recall vs Sketch Size in Bytes',
@@ -241,5 +341,22 @@ def main():
         plot_time_analysis(memory_results, count_time)
     plot_additional_analysis(memory_results)
 
+    layout_results = []
+    for st in ['cms', 'cms-blocked']:
+        layout_results.extend(run_memory_test(st, LAYOUT_TEST_BUCKETS))
+    print(layout_results)
+    plot_metrics(layout_results, 'buckets',
+                [('precision', 'Precision'), ('recall', 'Recall')],
+                'Precision/Recall vs Width, Row vs Blocked CMS',
+                'layout_analysis')
+    if layout_results:
+        plot_time_analysis(layout_results, layout_results[0]['count_time'])
+
+    agg_results = []
+    for st in ['cms', 'cs', 'mg', 'ss']:
+        agg_results.extend(run_agg_experiment(st, DEFAULT_PHIS))
+    print(agg_results)
+    plot_agg_speedup(agg_results)
+
 if __name__ == "__main__":
     main()
@@ -2,8 +2,10 @@
 #define MINHEAP_H
 
 #include <vector>
-#include <unordered_map>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 
 #define u64 uint64_t
 
@@ -12,81 +14,194 @@ struct HeapElement {
     u64 count;
 };
 
+// Top-k tracker: a binary min-heap on count plus an open addressing index
+// from item to heap position. Both live in one arena allocated up front and
+// sized from k, nothing is allocated after construction.
+//
+// Arena layout:
+//   HeapElement heap[k]     the heap itself
+//   uint32_t    where[k]    index slot that points at heap position i
+//   uint32_t    index[cap]  linear probing table, 0 = empty, else position + 1
 class MinHeap {
 private:
-    std::vector<HeapElement> heap;
-    std::unordered_map<u64, size_t> itemIndexMap;
+    HeapElement* heap;
+    uint32_t* where;
+    uint32_t* index;
+    size_t used;
+    size_t arenaBytes;
+    u64 mask;
+    int shift;
     const u64 k;
 
-    void siftDown(size_t index) {
-        size_t smallest = index;
-        size_t left = 2 * index + 1;
-        size_t right = 2 * index + 2;
+    size_t home(u64 item) const {
+        // Fibonacci hashing, the top bits are the best mixed ones.
+        return (size_t)((item * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
 
-        if (left < heap.size() && heap[left].count < heap[smallest].count) {
-            smallest = left;
-        }
-        if (right < heap.size() && heap[right].count < heap[smallest].count) {
-            smallest = right;
+    // Slot holding item, or the empty slot where it would go.
+    size_t probe(u64 item) const {
+        size_t t = home(item);
+        while (index[t] != 0 && heap[index[t] - 1].item != item) {
+            t = (t + 1) & mask;
         }
+        return t;
+    }
 
-        if (smallest != index) {
-            std::swap(heap[index], heap[smallest]);
-            itemIndexMap[heap[index].item] = index;
-            itemIndexMap[heap[smallest].item] = smallest;
-            siftDown(smallest);
+    void place(size_t pos, const HeapElement& e, uint32_t slot) {
+        heap[pos] = e;
+        where[pos] = slot;
+        index[slot] = (uint32_t)pos + 1;
+    }
+
+    // Backward shift deletion, keeps probe sequences intact without tombstones.
+    void unindex(size_t slot) {
+        size_t hole = slot;
+        size_t j = slot;
+        while (true) {
+            j = (j + 1) & mask;
+            if (index[j] == 0) break;
+            size_t h = home(heap[index[j] - 1].item);
+            if (((j - h) & mask) >= ((j - hole) & mask)) {
+                index[hole] = index[j];
+                where[index[hole] - 1] = (uint32_t)hole;
+                hole = j;
+            }
         }
+        index[hole] = 0;
     }
 
-    void siftUp(size_t index) {
-        while (index > 0) {
-            size_t parent = (index - 1) / 2;
-            if (heap[parent].count <= heap[index].count) break;
+    // Both sifts move a hole instead of swapping, so each step writes one
+    // heap slot and one index entry.
+    void siftDown(size_t pos) {
+        HeapElement e = heap[pos];
+        uint32_t slot = where[pos];
+        while (true) {
+            size_t child = 2 * pos + 1;
+            if (child >= used) break;
+            if (child + 1 < used && heap[child + 1].count < heap[child].count) {
+                child++;
+            }
+            if (heap[child].count >= e.count) break;
+            place(pos, heap[child], where[child]);
+            pos = child;
+            siftSteps++;
+        }
+        place(pos, e, slot);
+    }
 
-            std::swap(heap[parent], heap[index]);
-            itemIndexMap[heap[parent].item] = parent;
-            itemIndexMap[heap[index].item] = index;
-            index = parent;
+    void siftUp(size_t pos) {
+        HeapElement e = heap[pos];
+        uint32_t slot = where[pos];
+        while (pos > 0) {
+            size_t parent = (pos - 1) / 2;
+            if (heap[parent].count <= e.count) break;
+            place(pos, heap[parent], where[parent]);
+            pos = parent;
+            siftSteps++;
         }
+        place(pos, e, slot);
     }
 
 public:
+    // Instrumentation: levels moved by sifts, and roots evicted for a new item.
+    u64 siftSteps;
+    u64 evictions;
+
+    MinHeap(u64 k) : used(0), k(k), siftSteps(0), evictions(0) {
+        // Keep the index at most half full.
+        u64 cap = 8;
+        while (cap < 2 * k) cap <<= 1;
+        mask = cap - 1;
+        shift = 64 - __builtin_ctzll(cap);
+
+        size_t heapBytes = k * sizeof(HeapElement);
+        size_t whereBytes = k * sizeof(uint32_t);
+        arenaBytes = (heapBytes + whereBytes + cap * sizeof(uint32_t) + 63) & ~(size_t)63;
+        char* arena = (char*)aligned_alloc(64, arenaBytes);
+        if (!arena) {
+            fprintf(stderr, "Unable to allocate memory for sketch\n");
+            exit(1);
+        }
+        heap = (HeapElement*)arena;
+        where = (uint32_t*)(arena + heapBytes);
+        index = (uint32_t*)(arena + heapBytes + whereBytes);
+        for (u64 i = 0; i < cap; ++i) index[i] = 0;
+    }
+
+    ~MinHeap() {
+        free(heap);
+    }
 
-    MinHeap(u64 k) : k(k) {}
+    MinHeap(const MinHeap&) = delete;
+    MinHeap& operator=(const MinHeap&) = delete;
 
     void insertOrUpdate(u64 item, u64 count) {
-        if (itemIndexMap.find(item) != itemIndexMap.end()) {
+        if (used == k) {
+            // Fast reject: an absent item can not displace the root, and a
+            // present one already has a count >= the root's, so this would be
+            // a no-op either way. Also covers k == 0.
+            if (k == 0 || count <= heap[0].count) return;
+        }
+
+        size_t slot = probe(item);
+        if (index[slot] != 0) {
             // Existing item
-            size_t idx = itemIndexMap[item];
-            if (count > heap[idx].count) {
-                heap[idx].count = count;
-                siftDown(idx);
+            size_t pos = index[slot] - 1;
+            if (count > heap[pos].count) {
+                heap[pos].count = count;
+                siftDown(pos);
             }
-        } else {
+        } else if (used < k) {
             // New item
-            if (heap.size() < k) {
-                heap.push_back({item, count});
-                itemIndexMap[item] = heap.size() - 1;
-                siftUp(heap.size() - 1);
-            } else if (count > heap[0].count) {
-                // Evict smallest (root) and insert new
-                itemIndexMap.erase(heap[0].item);
-                heap[0] = {item, count};
-                itemIndexMap[item] = 0;
-                siftDown(0);
-            }
+            size_t pos = used++;
+            place(pos, {item, count}, (uint32_t)slot);
+            siftUp(pos);
+        } else {
+            // Evict smallest (root) and insert new. The deletion can shift
+            // entries, so look the slot up again afterwards.
+            unindex(where[0]);
+            place(0, {item, count}, (uint32_t)probe(item));
+            siftDown(0);
+            evictions++;
         }
     }
+
+    // Drops a tracked item's count to count, for deletions and negative
+    // deltas. Untracked items, or a count that is not lower, change nothing.
+    void lower(u64 item, u64 count) {
+        if (used == 0) return;
+        size_t slot = probe(item);
+        if (index[slot] == 0) return;
+        size_t pos = index[slot] - 1;
+        if (count >= heap[pos].count) return;
+        heap[pos].count = count;
+        siftUp(pos);
+    }
+
+    // Count an item must exceed to change the heap: the root's once the heap
+    // is full, 0 before that.
+    u64 threshold() const {
+        if (used < k) return 0;
+        return k ? heap[0].count : UINT64_MAX;
+    }
+
+    void clear() {
+        used = 0;
+        for (u64 i = 0; i <= mask; ++i) index[i] = 0;
+    }
   size_t size() const {
-    size_t total = sizeof(k) + sizeof(heap) + sizeof(itemIndexMap);
-    total += heap.capacity() * sizeof(HeapElement);
-    // key (8) + value (8) + hash (8) + pointers (16)
-    total += itemIndexMap.size() * (sizeof(u64) + sizeof(u64) + 16);
-    return total;
+    return sizeof(*this) + arenaBytes;
   }
     std::vector<HeapElement> getTopK() const {
+        return std::vector<HeapElement>(heap, heap + used);
+    }
+    // The tracked items in heap order, valid until the next update.
+    const HeapElement* view() const {
         return heap;
     }
+    size_t count() const {
+        return used;
+    }
 };
 
 #endif // MINHEAP_H
@@ -3,10 +3,14 @@
 #include <stdlib.h>
 #include "misra_gries.h"
 #include <math.h>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <vector>
 
 #define ZETA_1_5 2.6123
 
-MisraGries* mg_init(u64 N, double phi) {
+MisraGries* mg_init(u64 N, double phi, MGBackend backend) {
   MisraGries* mg = (MisraGries*) malloc(sizeof(MisraGries));
   // K value is caluclated based on the reinmann's zeta function zeta(1.5), which
   // is our zipfian parameter is equal to 2.6123, we assume the universe size is
@@ -14,45 +18,194 @@ MisraGries* mg_init(u64 N, double phi) {
   mg->k = (u64) floor(pow(1.0 / (phi * ZETA_1_5), 2.0/3.0));
   mg->k2 = mg->k * MG_MULT_FACTOR;
   printf("estimated k: %ld\n", mg->k);
-  mg->map = new std::unordered_map<u64, u64>();
+  mg->backend = backend;
+  mg->base = 0;
+  mg->decrements = 0;
+  mg->map = nullptr;
+  mg->summary = nullptr;
+  // Both keep up to k2 + 1 counters before decrementing.
+  if (backend == MGBackend::MAP) mg->map = new FlatCounterMap(mg->k2 + 1);
+  else mg->summary = new StreamSummary(mg->k2 + 1);
   return mg;
 }
 
-bool mg_add(MisraGries* sketch, u64 item) {
-  // If there is space, or the element exists add one to counter.
-  if (sketch->map->size() <= sketch->k2 || sketch->map->find(item) != sketch->map->end()){
-    (*sketch->map)[item]++;
+static bool mg_add_summary(MisraGries* sketch, u64 item, u64 weight) {
+  StreamSummary* ss = sketch->summary;
+  uint32_t node = ss->find(item);
+  if (node != StreamSummary::NIL) {
+    ss->increment(node, weight);
     return true;
   }
-  // decrement all counters
-  for (auto it = sketch->map->begin(); it != sketch->map->end(); ++it) {
-    it->second--;
+  if (!ss->full()) {
+    // Stored counts are offset by base, every live one is > base.
+    ss->insert(item, sketch->base + weight);
+    return true;
+  }
+  // Decrement all counters, the new item's included, by the smaller of its
+  // weight and the minimum counter: bump the offset, then drop the ones that
+  // reached zero, which can only be the minimum bucket. What is left of the
+  // weight goes into the freed counter.
+  u64 cut = std::min(weight, ss->minCount() - sketch->base);
+  sketch->base += cut;
+  sketch->decrements++;
+  while (!ss->empty() && ss->minCount() <= sketch->base) {
+    ss->erase(ss->minNode());
   }
+  if (weight > cut) ss->insert(item, sketch->base + weight - cut);
+  return true;
+}
 
-  // remove keys who's counter reaches 0
-  for (auto it = sketch->map->begin(); it != sketch->map->end();) {
-    if (it->second == 0) {
-      it = sketch->map->erase(it);
-    } else {
-      ++it;
-    }
+bool mg_add(MisraGries* sketch, u64 item, u64 weight) {
+  if (weight == 0) return true;
+  if (sketch->backend == MGBackend::SUMMARY) return mg_add_summary(sketch, item, weight);
+
+  // If the element exists, or there is space, add the weight to its counter.
+  FlatCounterMap* map = sketch->map;
+  size_t slot = map->find(item);
+  if (slot != FlatCounterMap::NIL) {
+    map->increment(slot, weight);
+    return true;
+  }
+  if (!map->full()) {
+    map->insert(item, weight);
+    return true;
   }
+  sketch->decrements++;
+  // decrement all counters by the smaller of the weight and the minimum,
+  // the ones reaching 0 are dropped
+  u64 cut = std::min(weight, map->minCount());
+  map->decrementAll(cut);
+  // the rest of the weight takes a freed counter
+  if (weight > cut) map->insert(item, weight - cut);
   return true;
 }
 
 u64 mg_estimate(MisraGries* sketch, u64 item) {
-  if (auto pair = sketch->map->find(item); pair != sketch->map->end()) {
-    return pair->second;
+  if (sketch->backend == MGBackend::SUMMARY) {
+    uint32_t node = sketch->summary->find(item);
+    if (node == StreamSummary::NIL) return 0;
+    return sketch->summary->count(node) - sketch->base;
+  }
+  size_t slot = sketch->map->find(item);
+  return slot == FlatCounterMap::NIL ? 0 : sketch->map->count(slot);
+}
+
+void mg_collect(const MisraGries* sketch, std::vector<std::pair<u64, u64>>* out) {
+  if (sketch->backend == MGBackend::SUMMARY) {
+    u64 base = sketch->base;
+    sketch->summary->forEach([out, base](u64 item, u64 count) {
+      out->push_back({item, count - base});
+    });
+    return;
+  }
+  sketch->map->forEach([out](u64 item, u64 count) { out->push_back({item, count}); });
+}
+
+void mg_merge(MisraGries* dst, const MisraGries* src) {
+  // Combine in a temporary map, cut, then rebuild dst. The summary is
+  // rebuilt in ascending count order so every insert appends at the tail.
+  std::vector<std::pair<u64, u64>> src_items, dst_items;
+  mg_collect(src, &src_items);
+  mg_collect(dst, &dst_items);
+  std::unordered_map<u64, u64> combined(dst_items.begin(), dst_items.end());
+  for (const auto& pair : src_items) combined[pair.first] += pair.second;
+
+  std::vector<std::pair<u64, u64>> items(combined.begin(), combined.end());
+  u64 cut = 0;
+  if (items.size() > dst->k2) {
+    std::nth_element(items.begin(), items.begin() + dst->k2, items.end(),
+                     [](const auto& a, const auto& b) { return a.second > b.second; });
+    cut = items[dst->k2].second;
+  }
+  if (dst->backend == MGBackend::SUMMARY) {
+    std::sort(items.begin(), items.end(),
+              [](const auto& a, const auto& b) { return a.second < b.second; });
+    dst->summary->clear();
+    dst->base = 0;
+    for (const auto& pair : items) {
+      if (pair.second > cut) dst->summary->insert(pair.first, pair.second - cut);
+    }
+    return;
+  }
+  dst->map->clear();
+  for (const auto& pair : items) {
+    if (pair.second > cut) dst->map->insert(pair.first, pair.second - cut);
+  }
+}
+
+bool mg_serialize(const MisraGries* sketch, SerWriter* w) {
+  std::vector<std::pair<u64, u64>> items;
+  mg_collect(sketch, &items);
+  ser_put_u64(w, (u64)sketch->backend);
+  ser_put_u64(w, sketch->k);
+  ser_put_u64(w, sketch->k2);
+  ser_put_u64(w, items.size());
+  for (const auto& pair : items) {
+    ser_put_u64(w, pair.first);
+    ser_put_u64(w, pair.second);
+  }
+  return w->ok;
+}
+
+MisraGries* mg_load(SerReader* r) {
+  u64 backend = ser_get_u64(r);
+  u64 k = ser_get_u64(r);
+  u64 k2 = ser_get_u64(r);
+  u64 n = ser_get_u64(r);
+  // Every pair takes 16 bytes, a larger count can only be a corrupt file.
+  if (!r->ok || backend > (u64)MGBackend::SUMMARY || k2 >= UINT32_MAX ||
+      n > k2 + 1 || n > (r->size - r->offset) / 16) {
+    return NULL;
+  }
+  std::vector<std::pair<u64, u64>> items(n);
+  for (u64 i = 0; i < n; ++i) {
+    items[i].first = ser_get_u64(r);
+    items[i].second = ser_get_u64(r);
+    if (items[i].second == 0) r->ok = false;
   }
-  return 0;
+  if (!r->ok) return NULL;
+
+  MisraGries* mg = (MisraGries*) malloc(sizeof(MisraGries));
+  mg->backend = (MGBackend)backend;
+  mg->k = k;
+  mg->k2 = k2;
+  mg->base = 0;
+  mg->decrements = 0;
+  mg->map = nullptr;
+  mg->summary = nullptr;
+  if (mg->backend == MGBackend::MAP) {
+    mg->map = new FlatCounterMap(k2 + 1);
+    for (const auto& pair : items) {
+      if (mg->map->find(pair.first) != FlatCounterMap::NIL) {
+        mg_free(mg);
+        return NULL;
+      }
+      mg->map->insert(pair.first, pair.second);
+    }
+  } else {
+    mg->summary = new StreamSummary(k2 + 1);
+    if (!mg->summary->insertAll(&items)) {
+      mg_free(mg);
+      return NULL;
+    }
+  }
+  return mg;
+}
+
+void mg_clear(MisraGries* sketch) {
+  if (sketch->backend == MGBackend::SUMMARY) sketch->summary->clear();
+  else sketch->map->clear();
+  sketch->base = 0;
 }
 
 void mg_free(MisraGries* sketch) {
   delete sketch->map;
+  delete sketch->summary;
   free(sketch);
 }
 
 u64 mg_size(MisraGries* sketch) {
   u64 base = sizeof(MisraGries);
-  return base + (sizeof(u64) * 2 * sketch->map->size());
+  if (sketch->backend == MGBackend::SUMMARY) return base + sketch->summary->size();
+  return base + sketch->map->size();
 }
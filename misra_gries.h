@@ -1,5 +1,9 @@
 #include <stdint.h>
-#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "flat_counter_map.h"
+#include "serialize.h"
+#include "stream_summary.h"
 
 #ifndef _MG_H_
 #define _MG_H_
@@ -13,24 +17,55 @@
 
 #define MIN(X, Y) X < Y ? X : Y
 
+enum class MGBackend {
+  MAP,     // flat hash table, a miss on a full table decrements every counter
+  SUMMARY, // stream-summary with a global decrement offset, O(1) amortized
+};
+
 typedef struct {
-  std::unordered_map<u64, u64> *map;
+  MGBackend backend;
+  FlatCounterMap *map;               // MAP backend, room for k2 + 1 counters
+  StreamSummary *summary;            // SUMMARY backend, holds count + base
+  u64 base;                          // total decrements applied to summary
   u64 k;
   u64 k2;
+  u64 decrements; // decrement-all steps taken
 } MisraGries;
 
-MisraGries* mg_init(u64 N, double phi);
+MisraGries* mg_init(u64 N, double phi, MGBackend backend = MGBackend::MAP);
 
-bool mg_add(MisraGries* sketch, u64 item);
+// Counts weight occurrences of item. A miss on a full summary decrements
+// every counter by min(weight, smallest counter) in one pass instead of
+// weight passes, the rest of the weight takes a freed counter.
+bool mg_add(MisraGries* sketch, u64 item, u64 weight = 1);
 
 u64 mg_estimate(MisraGries* sketch, u64 item);
 
+// Folds src into dst (mergeable summaries): counters are added, then if more
+// than k2 remain the (k2+1)-th largest is subtracted from all of them and the
+// non-positive ones are dropped. Linear in the size of the two summaries.
+void mg_merge(MisraGries* dst, const MisraGries* src);
+
 // MisraGries* mg_get_topk(MisraGries* sketch);
 
+// Appends every (item, estimate) pair of the summary to out, in no
+// particular order.
+void mg_collect(const MisraGries* sketch, std::vector<std::pair<u64, u64>>* out);
+
+// Drops every counter.
+void mg_clear(MisraGries* sketch);
+
 void mg_free(MisraGries* sketch);
 
+// Writes the backend, k, k2 and every (item, estimate) pair.
+bool mg_serialize(const MisraGries* sketch, SerWriter* w);
+
+// Reads a summary written by mg_serialize, NULL on a malformed file.
+MisraGries* mg_load(SerReader* r);
+
 // void mg_print_sketch_table(MisraGries* sketch);
 
+// Exact bytes held: the struct and the backend's arena.
 u64 mg_size(MisraGries* sketch);
 
 #endif
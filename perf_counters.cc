@@ -0,0 +1,85 @@
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perf_counters.h"
+
+static const char* perf_names[PERF_NUM_EVENTS] = {
+  "cycles", "instructions", "L1D misses", "LLC misses", "branch misses",
+};
+
+static void perf_attr(int event, struct perf_event_attr* attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->disabled = 1;
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  const u64 read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  switch (event) {
+    case PERF_CYCLES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PERF_INSTRUCTIONS:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PERF_L1D_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D | read_miss;
+      break;
+    case PERF_LLC_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_LL | read_miss;
+      break;
+    case PERF_BRANCH_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+  }
+}
+
+bool perf_open(PerfCounters* pc) {
+  bool any = false;
+  for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+    struct perf_event_attr attr;
+    perf_attr(e, &attr);
+    // This thread, any CPU, no group: each event is read on its own.
+    pc->fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    any |= pc->fds[e] >= 0;
+  }
+  return any;
+}
+
+void perf_start(PerfCounters* pc) {
+  for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+    if (pc->fds[e] < 0) continue;
+    ioctl(pc->fds[e], PERF_EVENT_IOC_RESET, 0);
+    ioctl(pc->fds[e], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void perf_stop(PerfCounters* pc, PerfSample* out) {
+  for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+    out->values[e] = PERF_UNAVAILABLE;
+    if (pc->fds[e] < 0) continue;
+    ioctl(pc->fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    u64 data[3]; // value, time enabled, time running
+    if (read(pc->fds[e], data, sizeof(data)) != sizeof(data) || data[2] == 0) continue;
+    out->values[e] = data[2] < data[1] ? (u64)((double)data[0] * data[1] / data[2]) : data[0];
+  }
+}
+
+void perf_close(PerfCounters* pc) {
+  for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+    if (pc->fds[e] >= 0) close(pc->fds[e]);
+    pc->fds[e] = -1;
+  }
+}
+
+const char* perf_event_name(int event) {
+  return event >= 0 && event < PERF_NUM_EVENTS ? perf_names[event] : "unknown";
+}
@@ -0,0 +1,45 @@
+#include <stdint.h>
+
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#define u64 uint64_t
+
+// Hardware events read through perf_event_open, user space only and for the
+// calling thread.
+enum PerfEvent {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,    // L1 data cache read misses
+  PERF_LLC_MISSES,    // last level cache read misses
+  PERF_BRANCH_MISSES,
+  PERF_NUM_EVENTS,
+};
+
+#define PERF_UNAVAILABLE UINT64_MAX
+
+typedef struct {
+  int fds[PERF_NUM_EVENTS]; // -1 for an event the kernel or CPU does not offer
+} PerfCounters;
+
+typedef struct {
+  u64 values[PERF_NUM_EVENTS]; // PERF_UNAVAILABLE for events that could not be opened
+} PerfSample;
+
+// Opens every event it can. False when none could be opened (no PMU, e.g.
+// in most VMs, or perf_event_paranoid too high), the counters then read
+// PERF_UNAVAILABLE and start/stop cost a few branches.
+bool perf_open(PerfCounters* pc);
+
+// Zeroes and enables the counters.
+void perf_start(PerfCounters* pc);
+
+// Disables the counters and reads them, scaled up when the kernel had to
+// multiplex them.
+void perf_stop(PerfCounters* pc, PerfSample* out);
+
+void perf_close(PerfCounters* pc);
+
+const char* perf_event_name(int event);
+
+#endif
@@ -0,0 +1,58 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "hashutil.h"
+
+#ifndef _ROW_HASH_H_
+#define _ROW_HASH_H_
+
+#define u64 uint64_t
+
+// How a CMS/CS derives the bucket (and sign) of every row for an item.
+enum class HashMode {
+  PER_ROW, // one MurmurHash64A per row, plus one per row for the CS sign
+  DOUBLE,  // Kirsch-Mitzenmacher: two hashes, row i uses h1 + i * h2
+  SLICED,  // one hash cut into log2(buckets) bit slices, needs power of two buckets
+};
+
+// Returns true when a single 64 bit hash has enough bits for every row's
+// bucket plus sign_bits extra bits.
+static inline bool row_hash_can_slice(u64 buckets, u64 rows, u64 sign_bits) {
+  if (buckets == 0 || (buckets & (buckets - 1)) != 0) return false;
+  return rows * __builtin_ctzll(buckets) + sign_bits <= 64;
+}
+
+// Falls back to DOUBLE if SLICED was asked for but does not fit.
+static inline HashMode row_hash_resolve(HashMode mode, u64 buckets, u64 rows,
+                                        u64 sign_bits) {
+  if (mode == HashMode::SLICED && !row_hash_can_slice(buckets, rows, sign_bits))
+    return HashMode::DOUBLE;
+  return mode;
+}
+
+static inline void row_hash_double(u64 item, u64 seed1, u64 seed2, u64* h1,
+                                   u64* h2) {
+  *h1 = MurmurHash64A(&item, sizeof(u64), seed1);
+  // Odd stride so consecutive rows never land on the same bucket for power of
+  // two bucket counts.
+  *h2 = MurmurHash64A(&item, sizeof(u64), seed2) | 1;
+}
+
+// Bucket of row i for the DOUBLE mode.
+static inline u64 row_hash_double_row(u64 h1, u64 h2, u64 i) {
+  return h1 + i * h2;
+}
+
+// splitmix64 step, expands one seed into a stream of well mixed row seeds.
+static inline u64 row_hash_next_seed(u64* state) {
+  u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Bucket of row i for the SLICED mode.
+static inline u64 row_hash_slice(u64 h, u64 buckets, u64 i) {
+  return (h >> (i * __builtin_ctzll(buckets))) & (buckets - 1);
+}
+
+#endif
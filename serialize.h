@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef _SERIALIZE_H_
+#define _SERIALIZE_H_
+
+#define u64 uint64_t
+
+// On disk format shared by every sketch: integers are little-endian, fixed
+// width, offsets count from the start of the file. Counter tables start on a
+// SER_PAGE boundary so a loader can mmap them in place.
+#define SER_MAGIC 0x48434b53 // "SKCH"
+#define SER_VERSION 2 // 2 adds the sketch's seen count to the header
+#define SER_PAGE 4096
+
+static inline bool ser_host_little_endian() {
+  return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+typedef struct {
+  int fd;
+  u64 offset; // bytes written so far
+  bool ok;    // false after the first failed write
+} SerWriter;
+
+typedef struct {
+  int fd;
+  u64 offset; // bytes consumed so far
+  u64 size;   // file size, nothing past it is read or mapped
+  bool ok;    // false after the first short read
+} SerReader;
+
+static inline void ser_write(SerWriter* w, const void* buf, size_t n) {
+  const char* p = (const char*)buf;
+  while (w->ok && n > 0) {
+    ssize_t done = write(w->fd, p, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) {
+      w->ok = false;
+      break;
+    }
+    p += done;
+    n -= done;
+    w->offset += done;
+  }
+}
+
+static inline void ser_put_u64(SerWriter* w, u64 v) {
+  unsigned char b[8];
+  for (int i = 0; i < 8; ++i) b[i] = (unsigned char)(v >> (8 * i));
+  ser_write(w, b, sizeof(b));
+}
+
+// Zero fills up to the next multiple of align.
+static inline void ser_pad(SerWriter* w, u64 align) {
+  static const char zeros[SER_PAGE] = {0};
+  u64 pad = (align - w->offset % align) % align;
+  ser_write(w, zeros, pad);
+}
+
+// Writes cells counters of the given byte width, little-endian.
+static inline void ser_put_counters(SerWriter* w, const void* table, u64 cells, u64 bytes) {
+  if (ser_host_little_endian()) {
+    ser_write(w, table, cells * bytes);
+    return;
+  }
+  const unsigned char* p = (const unsigned char*)table;
+  unsigned char b[8];
+  for (u64 i = 0; i < cells; ++i, p += bytes) {
+    for (u64 j = 0; j < bytes; ++j) b[j] = p[bytes - 1 - j];
+    ser_write(w, b, bytes);
+  }
+}
+
+static inline void ser_read(SerReader* r, void* buf, size_t n) {
+  char* p = (char*)buf;
+  if (r->offset + n > r->size) r->ok = false;
+  while (r->ok && n > 0) {
+    ssize_t done = read(r->fd, p, n);
+    if (done < 0 && errno == EINTR) continue;
+    if (done <= 0) {
+      r->ok = false;
+      break;
+    }
+    p += done;
+    n -= done;
+    r->offset += done;
+  }
+  if (!r->ok) memset(p, 0, n);
+}
+
+static inline u64 ser_get_u64(SerReader* r) {
+  unsigned char b[8];
+  ser_read(r, b, sizeof(b));
+  u64 v = 0;
+  for (int i = 0; i < 8; ++i) v |= (u64)b[i] << (8 * i);
+  return v;
+}
+
+// Maps the table of cells counters stored at the next align boundary,
+// private copy-on-write so the loaded sketch can keep ingesting without
+// touching the file. On big-endian hosts the table is read and swapped into
+// an aligned_alloc buffer instead. *mapped says which one the caller must
+// release (munmap or free). Returns NULL, holding nothing, on a truncated
+// file.
+static inline void* ser_get_counters(SerReader* r, u64 cells, u64 bytes, u64 align,
+                                     bool* mapped) {
+  u64 start = (r->offset + align - 1) / align * align;
+  u64 len = cells * bytes;
+  *mapped = false;
+  if (!r->ok || start + len > r->size || len == 0) {
+    r->ok = false;
+    return NULL;
+  }
+  if (ser_host_little_endian()) {
+    void* table = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, (off_t)start);
+    if (table == MAP_FAILED) {
+      r->ok = false;
+      return NULL;
+    }
+    *mapped = true;
+    r->offset = start + len;
+    lseek(r->fd, (off_t)r->offset, SEEK_SET);
+    return table;
+  }
+  unsigned char* table = (unsigned char*)aligned_alloc(64, (len + 63) & ~(u64)63);
+  if (!table) {
+    fprintf(stderr, "Unable to allocate memory for sketch\n");
+    exit(1);
+  }
+  lseek(r->fd, (off_t)start, SEEK_SET);
+  r->offset = start;
+  ser_read(r, table, len);
+  if (!r->ok) {
+    free(table);
+    return NULL;
+  }
+  for (u64 i = 0; i < cells; ++i) {
+    unsigned char* p = table + i * bytes;
+    for (u64 j = 0; j < bytes / 2; ++j) {
+      unsigned char t = p[j];
+      p[j] = p[bytes - 1 - j];
+      p[bytes - 1 - j] = t;
+    }
+  }
+  return table;
+}
+
+#endif
@@ -2,101 +2,372 @@
 #include "min_heap.h"
 #include "count_sketch.h"
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <functional>
 #include <map>
 #include <vector>
 #include "sketch.h"
 #include "misra_gries.h"
+#include "space_saving.h"
+#include "static_sketch.h"
 
 
-Sketch::Sketch(u64 N, double phi, SketchType type) : N(N), phi(phi), type(type) {
-  switch(type) {
-    case SketchType::CMS: backend = cms_init(N, phi); break;
-    case SketchType::CS: backend = cs_init(N, phi); break;
-    case SketchType::MG: backend = mg_init(N, phi); break;
+SketchConfig SketchConfig::FromError(double epsilon, double delta) {
+  SketchConfig config;
+  u64 width = (u64) ceil(M_E / epsilon);
+  config.width = 1;
+  while (config.width < width) config.width <<= 1;
+  config.depth = (u64) ceil(log(1.0 / delta));
+  if (config.depth == 0) config.depth = 1;
+  return config;
+}
+
+SketchConfig SketchConfig::FromDims(u64 width, u64 depth) {
+  SketchConfig config;
+  config.width = width;
+  config.depth = depth;
+  return config;
+}
+
+CountMinSketch* CmsBackend::init(u64 N, double phi, const SketchConfig& config) {
+  return cms_init(N, phi, config.hash_mode,
+                  config.width ? config.width : NUM_BUCKETS,
+                  config.depth ? config.depth : NUM_HASH_FUNCTIONS,
+                  config.cms_update, config.counters, config.overflow,
+                  config.cms_layout, config.seed, config.alloc);
+}
+
+CountSketch* CsBackend::init(u64 N, double phi, const SketchConfig& config) {
+  return cs_init(N, phi, config.hash_mode,
+                 config.width ? config.width : CS_NUM_BUCKETS,
+                 config.depth ? config.depth : NUM_HASH_FUNCTION_PAIRS,
+                 config.counters, config.overflow, config.seed, config.alloc);
+}
+
+MisraGries* MgBackend::init(u64 N, double phi, const SketchConfig& config) {
+  return mg_init(N, phi, config.mg_backend);
+}
+
+SpaceSaving* SsBackend::init(u64 N, double phi, const SketchConfig&) {
+  return ss_init(N, phi);
+}
+
+DyadicSketch* DyadicBackend::init(u64 N, double phi, const SketchConfig& config) {
+  return dcms_init(N, phi, config.width ? config.width : NUM_BUCKETS,
+                   config.depth ? config.depth : NUM_HASH_FUNCTIONS,
+                   config.universe_bits, config.seed, config.alloc);
+}
+
+void* make_backend(SketchType type, u64 N, double phi, const SketchConfig& config) {
+  return sketch_visit(type, [&](auto b) -> void* { return decltype(b)::init(N, phi, config); });
+}
+
+Sketch::Sketch(u64 N, double phi, SketchType type, const SketchConfig& config)
+    : buffer(nullptr), N(N), phi(phi), type(type), seen(0), rejected(0), version(0),
+      cached_version(UINT64_MAX), cached_phi(0) {
+  if (config.agg_slots) buffer = new AggBuffer(config.agg_slots);
+  backend = make_backend(type, N, phi, config);
+}
+
+Sketch::Sketch(Sketch&& other)
+    : backend(other.backend), buffer(other.buffer), N(other.N), phi(other.phi),
+      type(other.type), seen(other.seen), rejected(other.rejected), version(other.version),
+      cached(std::move(other.cached)), cached_version(other.cached_version),
+      cached_phi(other.cached_phi) {
+  other.backend = nullptr;
+  other.buffer = nullptr;
+}
+
+bool Sketch::Serialize(int fd) {
+  Flush();
+  SerWriter w = {fd, 0, true};
+  u64 phi_bits;
+  memcpy(&phi_bits, &phi, sizeof(phi_bits));
+  ser_put_u64(&w, SER_MAGIC);
+  ser_put_u64(&w, SER_VERSION);
+  ser_put_u64(&w, (u64)type);
+  ser_put_u64(&w, N);
+  ser_put_u64(&w, phi_bits);
+  ser_put_u64(&w, seen);
+  return sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::serialize(static_cast<typename B::State*>(backend), &w);
+  });
+}
+
+Sketch Sketch::Load(const char* path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Unable to open sketch file %s\n", path);
+    exit(1);
+  }
+  SerReader r = {fd, 0, (u64)st.st_size, true};
+  u64 magic = ser_get_u64(&r);
+  u64 version = ser_get_u64(&r);
+  u64 type = ser_get_u64(&r);
+  Sketch sketch;
+  sketch.N = ser_get_u64(&r);
+  u64 phi_bits = ser_get_u64(&r);
+  memcpy(&sketch.phi, &phi_bits, sizeof(phi_bits));
+  // Version 1 files did not record the seen count, N stands in for it.
+  sketch.seen = version >= 2 ? ser_get_u64(&r) : sketch.N;
+  if (!r.ok || magic != SER_MAGIC || version < 1 || version > SER_VERSION ||
+      type > (u64)SketchType::DYADIC) {
+    fprintf(stderr, "%s is not a sketch file of version %d\n", path, SER_VERSION);
+    exit(1);
   }
+  sketch.type = (SketchType)type;
+  sketch.backend = sketch_visit(sketch.type, [&](auto b) -> void* {
+    return decltype(b)::load(&r);
+  });
+  close(fd); // mappings stay valid
+  if (!sketch.backend) {
+    fprintf(stderr, "Sketch file %s is corrupt or truncated\n", path);
+    exit(1);
+  }
+  return sketch;
 }
 
-void Sketch::Add(u64 item) {
-  switch(type) {
-    case SketchType::CMS: cms_add(static_cast<CountMinSketch*>(backend), item); break;
-    case SketchType::CS:  cs_add(static_cast<CountSketch*>(backend), item); break;
-    case SketchType::MG:  mg_add(static_cast<MisraGries*>(backend), item); break;
+bool Sketch::Merge(const Sketch& other) {
+  if (type != other.type) return false;
+  Flush();
+  other.Flush();
+  bool ok = sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::merge(static_cast<typename B::State*>(backend),
+                    static_cast<const typename B::State*>(other.backend));
+  });
+  if (ok) {
+    seen += other.seen;
+    version++;
   }
+  return ok;
 }
 
-u64 Sketch::Estimate(u64 item) {
-  switch(type) {
-    case SketchType::CMS: return cms_estimate(static_cast<CountMinSketch*>(backend), item);
-    case SketchType::CS:  return cs_estimate(static_cast<CountSketch*>(backend), item);
-    case SketchType::MG: return mg_estimate(static_cast<MisraGries*>(backend), item);
+bool Sketch::Subtract(const Sketch& other) {
+  if (type != other.type) return false;
+  Flush();
+  other.Flush();
+  bool ok = sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::subtract(static_cast<typename B::State*>(backend),
+                       static_cast<const typename B::State*>(other.backend));
+  });
+  if (ok) {
+    seen -= std::min(seen, other.seen);
+    version++;
   }
-  return 0;
+  return ok;
 }
 
-u64 Sketch::Size() {
-  switch(type) {
-    case SketchType::CMS: return cms_size(static_cast<CountMinSketch*>(backend));
-    case SketchType::CS:  return cs_size(static_cast<CountSketch*>(backend));
-    case SketchType::MG:  return mg_size(static_cast<MisraGries*>(backend));
+void Sketch::AddToBackend(u64 item, u64 weight) {
+  sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    B::add(static_cast<typename B::State*>(backend), item, weight);
+  });
+}
+
+void Sketch::AddBatchToBackend(const u64* items, size_t n, const u64* weights) const {
+  sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    B::addBatch(static_cast<typename B::State*>(backend), items, n, weights);
+  });
+}
+
+void Sketch::Flush() const {
+  if (!buffer || buffer->empty()) return;
+  buffer->flush([this](const u64* items, const u64* weights, size_t n) {
+    AddBatchToBackend(items, n, weights);
+  });
+}
+
+void Sketch::Add(u64 item, u64 weight) {
+  if (type == SketchType::DYADIC && !dcms_fits(static_cast<DyadicSketch*>(backend), item)) {
+    rejected += weight;
+    return;
+  }
+  seen += weight;
+  version++;
+  if (!buffer) {
+    AddToBackend(item, weight);
+    return;
+  }
+  if (buffer->add(item, weight)) {
+    buffer->drain([this](const u64* items, const u64* weights, size_t n) {
+      AddBatchToBackend(items, n, weights);
+    });
   }
-  return 0;
 }
 
-std::multimap<u64, u64, std::greater<u64>> Sketch::HeavyHitters(double phi) {
-  std::multimap<u64, u64, std::greater<u64>> topK;
+bool Sketch::Update(u64 item, int64_t delta) {
+  if (delta >= 0) {
+    Add(item, (u64)delta);
+    return true;
+  }
+  // The buffer only holds positive counts, apply deletions behind them.
+  Flush();
+  bool ok = sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::update(static_cast<typename B::State*>(backend), item, delta);
+  });
+  if (ok) {
+    seen -= std::min(seen, 0 - (u64)delta); // |delta|, INT64_MIN included
+    version++;
+  }
+  return ok;
+}
+
+void Sketch::AddBatch(const u64* items, size_t n, const u64* weights) {
+  if (!buffer) {
+    if (type == SketchType::DYADIC) {
+      // dcms_add_batch leaves out what does not fit, so does seen.
+      const DyadicSketch* dcms = static_cast<DyadicSketch*>(backend);
+      for (size_t i = 0; i < n; ++i)
+        (dcms_fits(dcms, items[i]) ? seen : rejected) += weights ? weights[i] : 1;
+    } else if (weights) {
+      for (size_t i = 0; i < n; ++i) seen += weights[i];
+    } else {
+      seen += n;
+    }
+    version++;
+    AddBatchToBackend(items, n, weights);
+    return;
+  }
+  for (size_t i = 0; i < n; ++i) Add(items[i], weights ? weights[i] : 1);
+}
+
+u64 Sketch::Estimate(u64 item) {
+  Flush();
+  return sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::estimate(static_cast<typename B::State*>(backend), item);
+  });
+}
+
+u64 Sketch::RangeEstimate(u64 lo, u64 hi) {
+  if (type != SketchType::DYADIC) return 0;
+  Flush();
+  return dcms_range(static_cast<DyadicSketch*>(backend), lo, hi);
+}
+
+u64 Sketch::Quantile(double q) {
+  if (type != SketchType::DYADIC) return 0;
+  Flush();
+  return dcms_quantile(static_cast<DyadicSketch*>(backend), q);
+}
+
+u64 Sketch::Size() {
+  u64 extra = buffer ? buffer->size() : 0;
+  return extra + sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    return B::size(static_cast<typename B::State*>(backend));
+  });
+}
+
+SketchCounters Sketch::Counters() const {
+  SketchCounters c;
+  Flush();
+  sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    B::counters(static_cast<const typename B::State*>(backend), &c);
+  });
+  c.dyadic_rejected = rejected; // only DYADIC refuses items
+  return c;
+}
+
+// Largest estimate first, ties by item so equal sketches answer alike.
+static bool hh_before(const HeapElement& a, const HeapElement& b) {
+  return a.count != b.count ? a.count > b.count : a.item < b.item;
+}
+
+void Sketch::RefreshHeavyHitters(double phi) {
+  Flush();
+  if (cached_version == version && cached_phi == phi) return;
+  cached.clear();
+  double threshold = phi * seen;
+  size_t limit = SIZE_MAX; // MG/SS/DYADIC report at most k, like the CMS/CS heaps
   switch(type) {
-    case SketchType::CMS: {
-                           CountMinSketch *cms = static_cast<CountMinSketch*>(backend);
-                           std::vector<HeapElement> items = cms->heap->getTopK();
-                           for (size_t i = 0; i < items.size(); ++i) {
-                             topK.insert({
-                                    items.at(i).item,
-                                    items.at(i).count
-                                 });
-                           }
-                            break;
-                          }
+    case SketchType::CMS:
     case SketchType::CS: {
-                           CountSketch *cs = static_cast<CountSketch*>(backend);
-                           std::vector<HeapElement> items = cs->heap->getTopK();
-                           for (size_t i = 0; i < items.size(); ++i) {
-                             topK.insert({
-                                    items.at(i).item,
-                                    items.at(i).count
-                                 });
-                           }
-                          break;
-                         }
+      const MinHeap* heap = type == SketchType::CMS ? static_cast<CountMinSketch*>(backend)->heap
+                                                    : static_cast<CountSketch*>(backend)->heap;
+      const HeapElement* view = heap->view();
+      for (size_t i = 0; i < heap->count(); ++i)
+        if (view[i].count >= threshold) cached.push_back(view[i]);
+      break;
+    }
     case SketchType::MG: {
-                           MisraGries *mg = static_cast<MisraGries*>(backend);
-                           std::vector<std::pair<u64, u64>> pairs;
-                           for (const auto& pair : *mg->map) {
-                             pairs.push_back(pair);
-                           }
-
-                           std::sort(pairs.begin(), pairs.end(), [](const auto& a, const auto& b) {
-                             return a.second > b.second;
-                           });
-                           for (size_t i = 0; i < mg->k; ++i) {
-                             topK.insert({
-                                    pairs.at(i).first,
-                                    pairs.at(i).second,
-                                 });
-                           }
-                           break;
-                         }
+      MisraGries* mg = static_cast<MisraGries*>(backend);
+      // Every estimate is at most seen / (k2 + 1) below the true count.
+      threshold -= (double)seen / (mg->k2 + 1);
+      limit = mg->k;
+      if (mg->backend == MGBackend::SUMMARY) {
+        u64 base = mg->base;
+        mg->summary->forEachWhile([this, base, threshold, limit](u64 item, u64 count) {
+          if (count - base < threshold || cached.size() == limit) return false;
+          cached.push_back({item, count - base});
+          return true;
+        });
+      } else {
+        // No order to exploit, one pass over the table.
+        mg->map->forEach([this, threshold](u64 item, u64 count) {
+          if (count >= threshold) cached.push_back({item, count});
+        });
+      }
+      break;
+    }
+    case SketchType::SS: {
+      // Largest first, so the walk stops at the first light counter.
+      limit = static_cast<SpaceSaving*>(backend)->k;
+      static_cast<SpaceSaving*>(backend)->summary->forEachWhile(
+          [this, threshold, limit](u64 item, u64 count) {
+            if (count < threshold || cached.size() == limit) return false;
+            cached.push_back({item, count});
+            return true;
+          });
+      break;
+    }
+    case SketchType::DYADIC: {
+      DyadicSketch* dcms = static_cast<DyadicSketch*>(backend);
+      limit = dcms->k;
+      dcms_heavy_hitters(dcms, threshold, &cached);
+      break;
+    }
+  }
+  if (cached.size() > limit) {
+    std::partial_sort(cached.begin(), cached.begin() + limit, cached.end(), hh_before);
+    cached.resize(limit);
+  } else {
+    std::sort(cached.begin(), cached.end(), hh_before);
   }
+  cached_version = version;
+  cached_phi = phi;
+}
 
+size_t Sketch::HeavyHitters(double phi, HeapElement* out, size_t cap) {
+  RefreshHeavyHitters(phi);
+  std::copy(cached.begin(), cached.begin() + std::min(cap, cached.size()), out);
+  return cached.size();
+}
 
+std::multimap<u64, u64, std::greater<u64>> Sketch::HeavyHitters(double phi) {
+  RefreshHeavyHitters(phi);
+  std::multimap<u64, u64, std::greater<u64>> topK;
+  for (const HeapElement& e : cached) topK.insert({e.item, e.count});
   return topK;
 }
 
 Sketch::~Sketch() {
-  switch(type) {
-    case SketchType::CMS: cms_free(static_cast<CountMinSketch*>(backend)); break;
-    case SketchType::CS:  cs_free(static_cast<CountSketch*>(backend)); break;
-    case SketchType::MG:  mg_free(static_cast<MisraGries*>(backend)); break;
-  }
+  delete buffer;
+  if (!backend) return; // moved from
+  sketch_visit(type, [&](auto b) {
+    typedef decltype(b) B;
+    B::destroy(static_cast<typename B::State*>(backend));
+  });
 }
@@ -1,26 +1,156 @@
 #ifndef SKETCH_H
 #define SKETCH_H
 
+#include "agg_buffer.h"
 #include "count_min_sketch.h"
+#include "dyadic_sketch.h"
+#include "misra_gries.h"
 #include <cstdint>
 #include <functional>
 #include <map>
+#include <vector>
 
-enum class SketchType { CMS, CS, MG };
+// DYADIC is a Count-Min per prefix level (see dyadic_sketch.h): range and
+// quantile queries, heavy hitters found at query time instead of by a heap.
+enum class SketchType { CMS, CS, MG, SS, DYADIC };
 
+// Construction options. width/depth size a CMS/CS at runtime, 0 keeps the
+// compiled in NUM_BUCKETS x NUM_HASH_FUNCTIONS (CS_NUM_BUCKETS x
+// NUM_HASH_FUNCTION_PAIRS). Sizes with a compiled specialization (see
+// cms_kernels/cs_kernels) get the fast path, others the runtime sized one.
+struct SketchConfig {
+    u64 width = 0;
+    u64 depth = 0;
+    // DYADIC key width. Items >= 2^universe_bits are refused, not counted in
+    // Seen() (see SketchCounters::dyadic_rejected); every bit costs a level.
+    u64 universe_bits = 64;
+    HashMode hash_mode = HashMode::PER_ROW; // CMS and CS
+    CmsUpdate cms_update = CmsUpdate::STANDARD; // CMS
+    CmsLayout cms_layout = CmsLayout::ROWS;     // CMS
+    CounterWidth counters = CounterWidth::BITS64;     // CMS and CS
+    CounterOverflow overflow = CounterOverflow::PROMOTE; // CMS and CS
+    MGBackend mg_backend = MGBackend::MAP;  // MG
+    u64 seed = START_SEED; // CMS, CS and DYADIC, equal seeds make sketches mergeable
+    // Page size and NUMA node of the CMS, CS and DYADIC counter tables.
+    TableAlloc alloc;
+    // Slots of a pre-aggregation buffer in front of the backend (see
+    // AggBuffer), 0 for none. Any backend.
+    u64 agg_slots = 0;
+
+    // Count-Min bounds: error <= epsilon * N with probability >= 1 - delta.
+    // The width is rounded up to a power of two.
+    static SketchConfig FromError(double epsilon, double delta);
+    static SketchConfig FromDims(u64 width, u64 depth);
+};
+
+// Backend state of type built from config (CountMinSketch*, CountSketch*,
+// ...), the one place a SketchConfig is turned into xxx_init arguments.
+void* make_backend(SketchType type, u64 N, double phi, const SketchConfig& config);
+
+// Event counts the backends keep as they go, to tell where update time goes.
+struct SketchCounters {
+    u64 heap_sifts = 0;     // CMS/CS: levels moved by top-k heap sifts
+    u64 heap_evictions = 0; // CMS/CS: heap roots evicted, SS: minimum counters taken over
+    u64 mg_decrements = 0;  // MG: decrement-all steps
+    u64 map_rehashes = 0;   // MG (MAP backend): in place rebuilds clearing tombstones
+    u64 dyadic_rejected = 0; // DYADIC: weight of items outside the key space, not counted
+};
+
+template <typename B> class StaticSketch;
+
+// Runtime selected sketch: type picks the backend, every call dispatches on
+// it once (see sketch_visit), batches once per batch. StaticSketch<B> is the
+// same without the dispatch when the backend is known at compile time.
 class Sketch {
 private:
     void* backend;
+    AggBuffer* buffer; // null when not pre-aggregating
     u64 N;
     double phi;
     SketchType type;
+    u64 seen;    // total weight counted, the N_seen of the phi threshold
+    u64 rejected; // DYADIC weight refused for not fitting universe_bits
+    u64 version; // bumped by every update, keys the heavy hitter cache
+    // Last heavy hitter answer, largest first, valid while version and phi match.
+    std::vector<HeapElement> cached;
+    u64 cached_version;
+    double cached_phi;
+
+    Sketch() : backend(nullptr), buffer(nullptr), N(0), phi(0), type(SketchType::MG),
+               seen(0), rejected(0), version(0), cached_version(UINT64_MAX), cached_phi(0) {}
+    // Takes over a backend built elsewhere (StaticSketch::Release).
+    Sketch(SketchType type, void* backend, u64 N, double phi, u64 seen)
+        : backend(backend), buffer(nullptr), N(N), phi(phi), type(type), seen(seen),
+          rejected(0), version(0), cached_version(UINT64_MAX), cached_phi(0) {}
+    template <typename B> friend class StaticSketch;
+
+    void AddToBackend(u64 item, u64 weight);
+    void AddBatchToBackend(const u64* items, size_t n, const u64* weights) const;
+    // Pushes everything buffered into the backend. Does not change what the
+    // sketch has counted, so it runs on const sketches too.
+    void Flush() const;
+    // Recomputes cached for phi unless it is current.
+    void RefreshHeavyHitters(double phi);
 
 public:
-    Sketch(u64 N, double phi, SketchType type);
-    void Add(u64 item);
+    Sketch(u64 N, double phi, SketchType type, const SketchConfig& config = SketchConfig());
+    Sketch(Sketch&& other);
+    Sketch(const Sketch&) = delete;
+    Sketch& operator=(const Sketch&) = delete;
+
+    // Writes the sketch to fd, which must be at the start of a file (or a
+    // pipe): a header (magic, format version, type, N, phi, seen) and the
+    // backend's state, all little-endian, see serialize.h. Returns false on a
+    // failed write.
+    bool Serialize(int fd);
+    // Reads a sketch written by Serialize. CMS/CS counter tables are mapped
+    // copy-on-write from the file rather than read, so replace checkpoints by
+    // renaming a new file over the old one, not by rewriting it in place.
+    static Sketch Load(const char* path);
+
+    // Folds other's counts into this sketch: CMS/CS add their tables (both
+    // must be built with the same seed, dimensions and hash mode) and rebuild
+    // the top-k from both heaps, MG uses mg_merge. False, leaving this sketch
+    // untouched, for mismatched sketches or SS.
+    bool Merge(const Sketch& other);
+    // Removes other's counts, e.g. an earlier checkpoint of the same stream to
+    // get the counts of one interval. CMS/CS only, same rules as Merge.
+    bool Subtract(const Sketch& other);
+    // Counts weight occurrences of item in one update, so pre-aggregated
+    // (item, count) input costs one update per distinct item. With a
+    // pre-aggregation buffer items reach the backend in evicted batches, every
+    // query, Merge/Subtract and Serialize flushes the buffer first so answers
+    // always cover every item added so far.
+    void Add(u64 item, u64 weight = 1);
+    // Signed update for turnstile streams: CMS (standard updates only) and CS
+    // take negative deltas, MG/SS only non negative ones. False when the
+    // delta is rejected.
+    bool Update(u64 item, int64_t delta);
+    // Adds items[i] with weight weights[i], or 1 when weights is null.
+    void AddBatch(const u64* items, size_t n, const u64* weights = nullptr);
     u64 Estimate(u64 item);
+    // Estimated count of the items in [lo, hi] and the item at rank q * Seen(),
+    // DYADIC only (0 otherwise).
+    u64 RangeEstimate(u64 lo, u64 hi);
+    u64 Quantile(double q);
     u64 Size();
+    // Total weight counted so far (adds minus deletions, merged sketches'
+    // included).
+    u64 Seen() const { return seen; }
+    // Writes every tracked item whose estimate is at least phi * Seen(),
+    // largest first, to out[0 .. cap) and returns how many there are, which
+    // may be more than cap. MG lowers the threshold by its error bound
+    // Seen() / (k2 + 1) so no true heavy hitter is missed, MG and SS keep
+    // at most their k largest, as the CMS/CS heaps do. The candidates are
+    // read in place (heap, map or summary, the summaries stop at the first
+    // light counter) and only the passing ones are sorted. The answer is
+    // cached, so repeated queries without an update in between are a copy,
+    // and nothing is allocated once the cache has grown.
+    size_t HeavyHitters(double phi, HeapElement* out, size_t cap);
+    // Same answer as a map from item to estimate.
     std::multimap<u64, u64, std::greater<u64>> HeavyHitters(double phi);
+    // Counts since construction or Load.
+    SketchCounters Counters() const;
     ~Sketch();
 };
 
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "space_saving.h"
+
+#define ZETA_1_5 2.6123
+
+SpaceSaving* ss_init(u64 N, double phi) {
+  SpaceSaving* ss = (SpaceSaving*) malloc(sizeof(SpaceSaving));
+  // K value is caluclated based on the reinmann's zeta function zeta(1.5), which
+  // is our zipfian parameter is equal to 2.6123, we assume the universe size is
+  // large here >> 10^5.
+  ss->k = (u64) floor(pow(1.0 / (phi * ZETA_1_5), 2.0/3.0));
+  ss->m = ss->k * SS_MULT_FACTOR;
+  if (ss->m == 0) ss->m = 1;
+  ss->evictions = 0;
+  printf("estimated k: %ld\n", ss->k);
+  ss->summary = new StreamSummary(ss->m);
+  return ss;
+}
+
+bool ss_add(SpaceSaving* sketch, u64 item, u64 weight) {
+  if (weight == 0) return true;
+  StreamSummary* summary = sketch->summary;
+  uint32_t node = summary->find(item);
+  if (node == StreamSummary::NIL) {
+    if (!summary->full()) {
+      summary->insert(item, weight);
+      return true;
+    }
+    // Take over the smallest counter.
+    node = summary->minNode();
+    summary->rename(node, item);
+    sketch->evictions++;
+  }
+  summary->increment(node, weight);
+  return true;
+}
+
+u64 ss_estimate(SpaceSaving* sketch, u64 item) {
+  uint32_t node = sketch->summary->find(item);
+  if (node == StreamSummary::NIL) return 0;
+  return sketch->summary->count(node);
+}
+
+void ss_collect(const SpaceSaving* sketch, std::vector<std::pair<u64, u64>>* out) {
+  sketch->summary->forEach([out](u64 item, u64 count) {
+    out->push_back({item, count});
+  });
+}
+
+bool ss_serialize(const SpaceSaving* sketch, SerWriter* w) {
+  std::vector<std::pair<u64, u64>> items;
+  ss_collect(sketch, &items);
+  ser_put_u64(w, sketch->k);
+  ser_put_u64(w, sketch->m);
+  ser_put_u64(w, items.size());
+  for (const auto& pair : items) {
+    ser_put_u64(w, pair.first);
+    ser_put_u64(w, pair.second);
+  }
+  return w->ok;
+}
+
+SpaceSaving* ss_load(SerReader* r) {
+  u64 k = ser_get_u64(r);
+  u64 m = ser_get_u64(r);
+  u64 n = ser_get_u64(r);
+  if (!r->ok || m == 0 || m >= UINT32_MAX || n > m || n > (r->size - r->offset) / 16)
+    return NULL;
+  std::vector<std::pair<u64, u64>> items(n);
+  for (u64 i = 0; i < n; ++i) {
+    items[i].first = ser_get_u64(r);
+    items[i].second = ser_get_u64(r);
+  }
+  if (!r->ok) return NULL;
+
+  SpaceSaving* ss = (SpaceSaving*) malloc(sizeof(SpaceSaving));
+  ss->k = k;
+  ss->m = m;
+  ss->evictions = 0;
+  ss->summary = new StreamSummary(m);
+  if (!ss->summary->insertAll(&items)) {
+    ss_free(ss);
+    return NULL;
+  }
+  return ss;
+}
+
+void ss_free(SpaceSaving* sketch) {
+  delete sketch->summary;
+  free(sketch);
+}
+
+u64 ss_size(SpaceSaving* sketch) {
+  return sizeof(SpaceSaving) + sketch->summary->size();
+}
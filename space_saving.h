@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "serialize.h"
+#include "stream_summary.h"
+
+#ifndef _SS_H_
+#define _SS_H_
+
+#define u64 uint64_t
+
+#ifndef SS_MULT_FACTOR
+#define SS_MULT_FACTOR 100
+#endif
+
+// Space-Saving (Metwally et al.) over a stream-summary. Every update is O(1):
+// a miss on a full summary takes over the minimum counter and increments it,
+// so estimates never under count and over count by at most the minimum.
+typedef struct {
+  StreamSummary *summary;
+  u64 k;
+  u64 m; // number of counters, k * SS_MULT_FACTOR
+  u64 evictions; // minimum counters taken over by a new item
+} SpaceSaving;
+
+SpaceSaving* ss_init(u64 N, double phi);
+
+// Counts weight occurrences of item, a miss on a full summary takes over the
+// minimum counter and adds the whole weight to it.
+bool ss_add(SpaceSaving* sketch, u64 item, u64 weight = 1);
+
+u64 ss_estimate(SpaceSaving* sketch, u64 item);
+
+// Appends every (item, estimate) pair, largest first.
+void ss_collect(const SpaceSaving* sketch, std::vector<std::pair<u64, u64>>* out);
+
+void ss_free(SpaceSaving* sketch);
+
+// Writes k, the number of counters and every (item, estimate) pair.
+bool ss_serialize(const SpaceSaving* sketch, SerWriter* w);
+
+// Reads a summary written by ss_serialize, NULL on a malformed file.
+SpaceSaving* ss_load(SerReader* r);
+
+u64 ss_size(SpaceSaving* sketch);
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef STATIC_SKETCH_H
+#define STATIC_SKETCH_H
+
+#include "count_sketch.h"
+#include "sketch.h"
+#include "space_saving.h"
+#include <utility>
+
+// Backends: the state type of one SketchType and its calls, resolved at
+// compile time. CMS/CS still update through the kernel table picked from
+// the runtime (counter width, depth, width), which PROMOTE may swap mid
+// stream; only the cms_add/cs_add hop is skipped. fits says whether an item
+// is inside the key space. update, merge and subtract return false where
+// the backend cannot do them. init builds the state from a SketchConfig
+// exactly as the Sketch constructor does (defined in sketch.cc).
+struct CmsBackend {
+    typedef CountMinSketch State;
+    static constexpr SketchType type = SketchType::CMS;
+    static State* init(u64 N, double phi, const SketchConfig& config);
+    static bool fits(State*, u64) { return true; }
+    static void add(State* s, u64 item, u64 weight) { s->kernels->add(s, item, (int64_t)weight); }
+    static void addBatch(State* s, const u64* items, size_t n, const u64* weights) {
+        s->kernels->add_batch(s, items, weights, n);
+    }
+    static u64 estimate(State* s, u64 item) { return s->kernels->estimate(s, item); }
+    static u64 size(State* s) { return cms_size(s); }
+    static void destroy(State* s) { cms_free(s); }
+    static bool update(State* s, u64 item, int64_t delta) { return cms_update(s, item, delta); }
+    static bool merge(State* dst, const State* src) { return cms_merge(dst, src); }
+    static bool subtract(State* dst, const State* src) { return cms_subtract(dst, src); }
+    static bool serialize(const State* s, SerWriter* w) { return cms_serialize(s, w); }
+    static State* load(SerReader* r) { return cms_load(r); }
+    static void counters(const State* s, SketchCounters* c) {
+        c->heap_sifts = s->heap->siftSteps;
+        c->heap_evictions = s->heap->evictions;
+    }
+};
+
+struct CsBackend {
+    typedef CountSketch State;
+    static constexpr SketchType type = SketchType::CS;
+    static State* init(u64 N, double phi, const SketchConfig& config);
+    static bool fits(State*, u64) { return true; }
+    static void add(State* s, u64 item, u64 weight) { s->kernels->add(s, item, (i64)weight); }
+    static void addBatch(State* s, const u64* items, size_t n, const u64* weights) {
+        for (size_t i = 0; i < n; ++i) add(s, items[i], weights ? weights[i] : 1);
+    }
+    static u64 estimate(State* s, u64 item) { return s->kernels->estimate(s, item); }
+    static u64 size(State* s) { return cs_size(s); }
+    static void destroy(State* s) { cs_free(s); }
+    static bool update(State* s, u64 item, int64_t delta) { return cs_update(s, item, delta); }
+    static bool merge(State* dst, const State* src) { return cs_merge(dst, src); }
+    static bool subtract(State* dst, const State* src) { return cs_subtract(dst, src); }
+    static bool serialize(const State* s, SerWriter* w) { return cs_serialize(s, w); }
+    static State* load(SerReader* r) { return cs_load(r); }
+    static void counters(const State* s, SketchCounters* c) {
+        c->heap_sifts = s->heap->siftSteps;
+        c->heap_evictions = s->heap->evictions;
+    }
+};
+
+struct MgBackend {
+    typedef MisraGries State;
+    static constexpr SketchType type = SketchType::MG;
+    static State* init(u64 N, double phi, const SketchConfig& config);
+    static bool fits(State*, u64) { return true; }
+    static void add(State* s, u64 item, u64 weight) { mg_add(s, item, weight); }
+    static void addBatch(State* s, const u64* items, size_t n, const u64* weights) {
+        for (size_t i = 0; i < n; ++i) mg_add(s, items[i], weights ? weights[i] : 1);
+    }
+    static u64 estimate(State* s, u64 item) { return mg_estimate(s, item); }
+    static u64 size(State* s) { return mg_size(s); }
+    static void destroy(State* s) { mg_free(s); }
+    static bool update(State*, u64, int64_t) { return false; }
+    static bool merge(State* dst, const State* src) {
+        mg_merge(dst, src);
+        return true;
+    }
+    static bool subtract(State*, const State*) { return false; }
+    static bool serialize(const State* s, SerWriter* w) { return mg_serialize(s, w); }
+    static State* load(SerReader* r) { return mg_load(r); }
+    static void counters(const State* s, SketchCounters* c) {
+        c->mg_decrements = s->decrements;
+        c->map_rehashes = s->map ? s->map->rebuildCount() : 0;
+    }
+};
+
+struct SsBackend {
+    typedef SpaceSaving State;
+    static constexpr SketchType type = SketchType::SS;
+    static State* init(u64 N, double phi, const SketchConfig& config);
+    static bool fits(State*, u64) { return true; }
+    static void add(State* s, u64 item, u64 weight) { ss_add(s, item, weight); }
+    static void addBatch(State* s, const u64* items, size_t n, const u64* weights) {
+        for (size_t i = 0; i < n; ++i) ss_add(s, items[i], weights ? weights[i] : 1);
+    }
+    static u64 estimate(State* s, u64 item) { return ss_estimate(s, item); }
+    static u64 size(State* s) { return ss_size(s); }
+    static void destroy(State* s) { ss_free(s); }
+    static bool update(State*, u64, int64_t) { return false; }
+    static bool merge(State*, const State*) { return false; }
+    static bool subtract(State*, const State*) { return false; }
+    static bool serialize(const State* s, SerWriter* w) { return ss_serialize(s, w); }
+    static State* load(SerReader* r) { return ss_load(r); }
+    static void counters(const State* s, SketchCounters* c) { c->heap_evictions = s->evictions; }
+};
+
+struct DyadicBackend {
+    typedef DyadicSketch State;
+    static constexpr SketchType type = SketchType::DYADIC;
+    static State* init(u64 N, double phi, const SketchConfig& config);
+    static bool fits(State* s, u64 item) { return dcms_fits(s, item); }
+    static void add(State* s, u64 item, u64 weight) { dcms_add(s, item, weight); }
+    static void addBatch(State* s, const u64* items, size_t n, const u64* weights) {
+        dcms_add_batch(s, items, n, weights);
+    }
+    static u64 estimate(State* s, u64 item) { return dcms_estimate(s, item); }
+    static u64 size(State* s) { return dcms_size(s); }
+    static void destroy(State* s) { dcms_free(s); }
+    static bool update(State*, u64, int64_t) { return false; }
+    static bool merge(State* dst, const State* src) { return dcms_merge(dst, src); }
+    static bool subtract(State* dst, const State* src) { return dcms_subtract(dst, src); }
+    static bool serialize(const State* s, SerWriter* w) { return dcms_serialize(s, w); }
+    static State* load(SerReader* r) { return dcms_load(r); }
+    static void counters(const State*, SketchCounters*) {}
+};
+
+// Calls f(Backend()) for the backend of type, so one switch selects a
+// monomorphic body: f is instantiated once per backend.
+template <typename F>
+inline auto sketch_visit(SketchType type, F f) {
+    switch (type) {
+        case SketchType::CMS: return f(CmsBackend());
+        case SketchType::CS: return f(CsBackend());
+        case SketchType::MG: return f(MgBackend());
+        case SketchType::SS: return f(SsBackend());
+        case SketchType::DYADIC: return f(DyadicBackend());
+    }
+    __builtin_unreachable();
+}
+
+// Sketch with its backend fixed at compile time: Add and Estimate call into
+// B with no type switch, no pre-aggregation buffer and no heavy hitter cache
+// to keep current. MG/SS/DYADIC updates are direct calls; CMS/CS keep one
+// indirect call into their kernel table. The queries only Sketch has (heavy
+// hitters, merging, serialization) are reached through Release.
+template <typename B>
+class StaticSketch {
+private:
+    typename B::State* state;
+    u64 N;
+    double phi;
+    u64 seen;
+
+public:
+    // config.agg_slots is ignored, everything else applies as for Sketch.
+    StaticSketch(u64 N, double phi, const SketchConfig& config = SketchConfig())
+        : state(B::init(N, phi, config)), N(N), phi(phi), seen(0) {}
+    StaticSketch(StaticSketch&& other)
+        : state(other.state), N(other.N), phi(other.phi), seen(other.seen) {
+        other.state = nullptr;
+    }
+    StaticSketch(const StaticSketch&) = delete;
+    StaticSketch& operator=(const StaticSketch&) = delete;
+    ~StaticSketch() {
+        if (state) B::destroy(state);
+    }
+
+    // Items outside a DYADIC key space are dropped uncounted, as by Sketch.
+    void Add(u64 item, u64 weight = 1) {
+        if (!B::fits(state, item)) return;
+        seen += weight;
+        B::add(state, item, weight);
+    }
+    void AddBatch(const u64* items, size_t n, const u64* weights = nullptr) {
+        if (weights) {
+            for (size_t i = 0; i < n; ++i) seen += B::fits(state, items[i]) ? weights[i] : 0;
+        } else {
+            for (size_t i = 0; i < n; ++i) seen += B::fits(state, items[i]);
+        }
+        B::addBatch(state, items, n, weights);
+    }
+    u64 Estimate(u64 item) { return B::estimate(state, item); }
+    u64 Size() { return B::size(state); }
+    u64 Seen() const { return seen; }
+    typename B::State* Backend() { return state; }
+
+    // Hands the backend, with everything counted so far, to a Sketch and
+    // leaves this one empty (only destructible).
+    Sketch Release() {
+        Sketch sketch(B::type, state, N, phi, seen);
+        state = nullptr;
+        return sketch;
+    }
+};
+
+#endif
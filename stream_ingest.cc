@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "stream_ingest.h"
+
+static inline bool ingest_host_little_endian() {
+  return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+static void ingest_swap(u64* items, size_t n) {
+  for (size_t i = 0; i < n; ++i) items[i] = __builtin_bswap64(items[i]);
+}
+
+// Reads up to len bytes, short only at end of input. -1 on error.
+static ssize_t ingest_read_full(int fd, char* buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = read(fd, buf + done, len - done);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return -1;
+    if (r == 0) break;
+    done += r;
+  }
+  return done;
+}
+
+static bool ingest_mapped(int fd, u64 size, IngestFn& fn, IngestStats* stats) {
+  if (size == 0) return true;
+  char* data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) return false;
+  madvise(data, size, MADV_SEQUENTIAL);
+  stats->mapped = true;
+  u64 whole = size / sizeof(u64) * sizeof(u64);
+  for (u64 at = 0; at < whole; at += INGEST_CHUNK) {
+    u64 len = whole - at < INGEST_CHUNK ? whole - at : INGEST_CHUNK;
+    fn((const u64*)(data + at), len / sizeof(u64));
+    stats->items += len / sizeof(u64);
+    // Consumed pages can go, they are still in the page cache if needed.
+    madvise(data + at, len, MADV_DONTNEED);
+  }
+  stats->bytes = size;
+  munmap(data, size);
+  return true;
+}
+
+// Two buffers: the reader thread fills one while the caller consumes the
+// other. A buffer is either owned by the reader (ready == false) or holds
+// `len` bytes for the consumer (ready == true), len == 0 marks the end.
+typedef struct {
+  char* data;
+  size_t len;
+  bool ready;
+} IngestBuffer;
+
+static bool ingest_buffered(int fd, IngestFn& fn, IngestStats* stats) {
+  IngestBuffer bufs[2];
+  for (IngestBuffer& b : bufs) {
+    b.data = (char*)aligned_alloc(64, INGEST_CHUNK);
+    b.len = 0;
+    b.ready = false;
+    if (!b.data) {
+      fprintf(stderr, "Unable to allocate ingest buffers\n");
+      exit(1);
+    }
+  }
+  std::mutex lock;
+  std::condition_variable cv;
+  bool failed = false;
+
+  std::thread reader([&] {
+    // Bytes of a partial record carried over to the start of the next buffer.
+    char carry[sizeof(u64)];
+    size_t carried = 0;
+    for (size_t i = 0;; i ^= 1) {
+      IngestBuffer& b = bufs[i];
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&b] { return !b.ready; });
+      }
+      memcpy(b.data, carry, carried);
+      ssize_t got = ingest_read_full(fd, b.data + carried, INGEST_CHUNK - carried);
+      size_t len = got < 0 ? 0 : carried + got;
+      size_t whole = len / sizeof(u64) * sizeof(u64);
+      carried = len - whole;
+      memcpy(carry, b.data + whole, carried);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stats->bytes += got < 0 ? 0 : got;
+        failed |= got < 0;
+        b.len = whole;
+        b.ready = true;
+      }
+      cv.notify_all();
+      if (whole == 0) break;
+    }
+  });
+
+  for (size_t i = 0;; i ^= 1) {
+    IngestBuffer& b = bufs[i];
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      cv.wait(guard, [&b] { return b.ready; });
+    }
+    if (b.len == 0) break;
+    size_t n = b.len / sizeof(u64);
+    if (!ingest_host_little_endian()) ingest_swap((u64*)b.data, n);
+    fn((const u64*)b.data, n);
+    stats->items += n;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      b.ready = false;
+    }
+    cv.notify_all();
+  }
+  reader.join();
+  for (IngestBuffer& b : bufs) free(b.data);
+  return !failed;
+}
+
+bool ingest_file(const char* path, IngestFn fn, IngestStats* stats) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  stats->items = 0;
+  stats->bytes = 0;
+  stats->seconds = 0;
+  stats->mapped = false;
+  bool from_stdin = strcmp(path, "-") == 0;
+  int fd = from_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  bool ok = false;
+  struct stat st;
+  // Records are consumed in place from a mapping, so only on little-endian
+  // hosts; anything else goes through the swapping read() path.
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && ingest_host_little_endian())
+    ok = ingest_mapped(fd, st.st_size, fn, stats);
+  if (!stats->mapped) ok = ingest_buffered(fd, fn, stats);
+  if (!from_stdin) close(fd);
+  stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return ok;
+}
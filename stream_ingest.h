@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#ifndef _STREAM_INGEST_H_
+#define _STREAM_INGEST_H_
+
+#define u64 uint64_t
+
+// Bytes handed to the consumer per call, and the size of each of the two
+// read() buffers for pipes.
+#ifndef INGEST_CHUNK
+#define INGEST_CHUNK (4 << 20)
+#endif
+
+typedef struct {
+  u64 items;      // records handed to the consumer
+  u64 bytes;      // bytes read, a trailing partial record included
+  double seconds; // wall time from open to the last consumer call
+  bool mapped;    // read through mmap rather than read()
+} IngestStats;
+
+// Consumer of a chunk of records, e.g. Sketch::AddBatch.
+typedef std::function<void(const u64* items, size_t n)> IngestFn;
+
+// Streams fixed width little-endian u64 records from path ("-" for stdin)
+// into fn, INGEST_CHUNK bytes at a time, without ever holding the whole
+// input. Regular files are mmapped with MADV_SEQUENTIAL and every consumed
+// chunk is dropped from the mapping again, so the resident set stays at a
+// few chunks. Pipes (or files that can not be mapped) are read with large
+// read()s on a second thread into two alternating buffers, so the next
+// chunk is read while fn works on the current one. A trailing partial
+// record is ignored. Returns false when the input can not be opened or a
+// read fails.
+bool ingest_file(const char* path, IngestFn fn, IngestStats* stats);
+
+#endif
@@ -0,0 +1,277 @@
+#ifndef STREAM_SUMMARY_H
+#define STREAM_SUMMARY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#define u64 uint64_t
+
+// Stream-summary (Metwally et al.): items with equal counts share a bucket,
+// buckets form a list sorted by count, so the minimum is always the head and
+// a +1 moves an item to the next bucket in O(1).
+//
+// Everything is index based and lives in one arena sized from the capacity,
+// nodes and buckets are recycled through free lists, nothing is allocated
+// after construction. Items are found through an open addressing index
+// (linear probing, at most half full, backward shift deletion).
+class StreamSummary {
+public:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+private:
+    struct Node {
+        u64 item;
+        uint32_t bucket;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t slot; // index slot pointing at this node
+    };
+
+    struct Bucket {
+        u64 count;
+        uint32_t head; // first node
+        uint32_t prev;
+        uint32_t next;
+    };
+
+    Node* nodes;
+    Bucket* buckets;
+    uint32_t* index; // 0 = empty, else node + 1
+    size_t arenaBytes;
+    u64 mask;
+    int shift;
+    uint32_t minBucket;
+    uint32_t maxBucket;
+    uint32_t freeNodes;
+    uint32_t freeBuckets;
+    size_t used;
+    const size_t cap;
+
+    size_t home(u64 item) const {
+        return (size_t)((item * 0x9E3779B97F4A7C15ULL) >> shift);
+    }
+
+    size_t probe(u64 item) const {
+        size_t t = home(item);
+        while (index[t] != 0 && nodes[index[t] - 1].item != item) {
+            t = (t + 1) & mask;
+        }
+        return t;
+    }
+
+    void unindex(size_t slot) {
+        size_t hole = slot;
+        size_t j = slot;
+        while (true) {
+            j = (j + 1) & mask;
+            if (index[j] == 0) break;
+            size_t h = home(nodes[index[j] - 1].item);
+            if (((j - h) & mask) >= ((j - hole) & mask)) {
+                index[hole] = index[j];
+                nodes[index[hole] - 1].slot = (uint32_t)hole;
+                hole = j;
+            }
+        }
+        index[hole] = 0;
+    }
+
+    // New bucket with the given count linked right after `after` (or at the
+    // head when after == NIL).
+    uint32_t newBucket(u64 count, uint32_t after) {
+        uint32_t b = freeBuckets;
+        freeBuckets = buckets[b].next;
+        buckets[b].count = count;
+        buckets[b].head = NIL;
+        buckets[b].prev = after;
+        buckets[b].next = after == NIL ? minBucket : buckets[after].next;
+        if (buckets[b].next != NIL) buckets[buckets[b].next].prev = b;
+        else maxBucket = b;
+        if (after == NIL) minBucket = b;
+        else buckets[after].next = b;
+        return b;
+    }
+
+    void freeBucket(uint32_t b) {
+        if (buckets[b].prev != NIL) buckets[buckets[b].prev].next = buckets[b].next;
+        else minBucket = buckets[b].next;
+        if (buckets[b].next != NIL) buckets[buckets[b].next].prev = buckets[b].prev;
+        else maxBucket = buckets[b].prev;
+        buckets[b].next = freeBuckets;
+        freeBuckets = b;
+    }
+
+    void attach(uint32_t n, uint32_t b) {
+        nodes[n].bucket = b;
+        nodes[n].prev = NIL;
+        nodes[n].next = buckets[b].head;
+        if (buckets[b].head != NIL) nodes[buckets[b].head].prev = n;
+        buckets[b].head = n;
+    }
+
+    // Unlinks n from its bucket, returns the bucket it was in.
+    uint32_t detach(uint32_t n) {
+        uint32_t b = nodes[n].bucket;
+        if (nodes[n].prev != NIL) nodes[nodes[n].prev].next = nodes[n].next;
+        else buckets[b].head = nodes[n].next;
+        if (nodes[n].next != NIL) nodes[nodes[n].next].prev = nodes[n].prev;
+        return b;
+    }
+
+    // Bucket holding exactly count, created if needed, searching upwards from
+    // `from` (or from the head when from == NIL).
+    uint32_t bucketFor(u64 count, uint32_t from) {
+        uint32_t prev = NIL;
+        uint32_t b = from == NIL ? minBucket : from;
+        if (from != NIL) prev = buckets[from].prev;
+        // Appending in ascending order (merges, rebuilds) hits the tail.
+        if (maxBucket != NIL && count >= buckets[maxBucket].count) {
+            prev = maxBucket;
+            b = maxBucket;
+        }
+        while (b != NIL && buckets[b].count < count) {
+            prev = b;
+            b = buckets[b].next;
+        }
+        if (b != NIL && buckets[b].count == count) return b;
+        return newBucket(count, prev);
+    }
+
+public:
+    StreamSummary(size_t capacity) : used(0), cap(capacity) {
+        u64 icap = 8;
+        while (icap < 2 * cap) icap <<= 1;
+        mask = icap - 1;
+        shift = 64 - __builtin_ctzll(icap);
+
+        size_t nodeBytes = cap * sizeof(Node);
+        size_t bucketBytes = cap * sizeof(Bucket);
+        arenaBytes = (nodeBytes + bucketBytes + icap * sizeof(uint32_t) + 63) & ~(size_t)63;
+        char* arena = (char*)aligned_alloc(64, arenaBytes);
+        if (!arena) {
+            fprintf(stderr, "Unable to allocate memory for sketch\n");
+            exit(1);
+        }
+        nodes = (Node*)arena;
+        buckets = (Bucket*)(arena + nodeBytes);
+        index = (uint32_t*)(arena + nodeBytes + bucketBytes);
+        clear();
+    }
+
+    ~StreamSummary() {
+        free(nodes);
+    }
+
+    StreamSummary(const StreamSummary&) = delete;
+    StreamSummary& operator=(const StreamSummary&) = delete;
+
+    void clear() {
+        used = 0;
+        minBucket = maxBucket = NIL;
+        for (size_t i = 0; i < cap; ++i) {
+            nodes[i].next = i + 1 < cap ? (uint32_t)(i + 1) : NIL;
+            buckets[i].next = i + 1 < cap ? (uint32_t)(i + 1) : NIL;
+        }
+        freeNodes = cap ? 0 : NIL;
+        freeBuckets = cap ? 0 : NIL;
+        memset(index, 0, (mask + 1) * sizeof(uint32_t));
+    }
+
+    // Node of item, or NIL.
+    uint32_t find(u64 item) const {
+        size_t t = probe(item);
+        return index[t] == 0 ? NIL : index[t] - 1;
+    }
+
+    // Adds an absent item, there must be room (full() == false).
+    uint32_t insert(u64 item, u64 count) {
+        uint32_t n = freeNodes;
+        freeNodes = nodes[n].next;
+        nodes[n].item = item;
+        size_t t = probe(item);
+        index[t] = n + 1;
+        nodes[n].slot = (uint32_t)t;
+        attach(n, bucketFor(count, NIL));
+        used++;
+        return n;
+    }
+
+    // Fills an empty summary with (item, count) pairs, at most capacity() of
+    // them. Inserted in ascending count order, so every insert appends at the
+    // tail. False, leaving a partial summary, on a duplicate item.
+    bool insertAll(std::vector<std::pair<u64, u64>>* items) {
+        std::sort(items->begin(), items->end(),
+                  [](const auto& a, const auto& b) { return a.second < b.second; });
+        for (const auto& pair : *items) {
+            if (find(pair.first) != NIL) return false;
+            insert(pair.first, pair.second);
+        }
+        return true;
+    }
+
+    void increment(uint32_t n, u64 delta) {
+        uint32_t b = nodes[n].bucket;
+        u64 count = buckets[b].count + delta;
+        detach(n);
+        uint32_t to = bucketFor(count, b);
+        attach(n, to);
+        if (buckets[b].head == NIL) freeBucket(b);
+    }
+
+    void erase(uint32_t n) {
+        uint32_t b = detach(n);
+        if (buckets[b].head == NIL) freeBucket(b);
+        unindex(nodes[n].slot);
+        nodes[n].next = freeNodes;
+        freeNodes = n;
+        used--;
+    }
+
+    // Gives node n a new item, keeping its count (Space-Saving replacement).
+    void rename(uint32_t n, u64 item) {
+        unindex(nodes[n].slot);
+        nodes[n].item = item;
+        size_t t = probe(item);
+        index[t] = n + 1;
+        nodes[n].slot = (uint32_t)t;
+    }
+
+    u64 item(uint32_t n) const { return nodes[n].item; }
+    u64 count(uint32_t n) const { return buckets[nodes[n].bucket].count; }
+
+    // Smallest count and one node holding it, only valid when not empty.
+    u64 minCount() const { return buckets[minBucket].count; }
+    uint32_t minNode() const { return buckets[minBucket].head; }
+
+    bool empty() const { return used == 0; }
+    bool full() const { return used == cap; }
+    size_t entries() const { return used; }
+    size_t capacity() const { return cap; }
+
+    // Calls fn(item, count) for every entry, from the largest count down.
+    template <typename F>
+    void forEach(F fn) const {
+        for (uint32_t b = maxBucket; b != NIL; b = buckets[b].prev)
+            for (uint32_t n = buckets[b].head; n != NIL; n = nodes[n].next)
+                fn(nodes[n].item, buckets[b].count);
+    }
+
+    // forEach until fn returns false.
+    template <typename F>
+    void forEachWhile(F fn) const {
+        for (uint32_t b = maxBucket; b != NIL; b = buckets[b].prev)
+            for (uint32_t n = buckets[b].head; n != NIL; n = nodes[n].next)
+                if (!fn(nodes[n].item, buckets[b].count)) return;
+    }
+
+    size_t size() const {
+        return sizeof(*this) + arenaBytes;
+    }
+};
+
+#endif // STREAM_SUMMARY_H
@@ -0,0 +1,154 @@
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "table_alloc.h"
+
+static const char* table_pages_names[] = {"default", "thp", "hugetlb"};
+
+static bool hugetlb_warned = false;
+
+static u64 table_page() {
+  static u64 page = (u64)sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+static inline u64 round_up(u64 n, u64 align) {
+  return (n + align - 1) / align * align;
+}
+
+static int table_local_node() {
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+  return (int)node;
+}
+
+// Binds [table, table + len) to node before anything touches it.
+static void table_bind(void* table, u64 len, int node) {
+  if (node == TABLE_ANY_NODE) return;
+  if (node == TABLE_LOCAL_NODE) node = table_local_node();
+  unsigned long mask[16] = {0};
+  if (node < 0 || node >= (int)(sizeof(mask) * 8)) {
+    fprintf(stderr, "Invalid NUMA node %d\n", node);
+    exit(1);
+  }
+  mask[node / 64] = 1UL << (node % 64);
+  if (syscall(SYS_mbind, table, len, MPOL_BIND, mask, sizeof(mask) * 8, 0) != 0) {
+    fprintf(stderr, "Unable to bind sketch memory to NUMA node %d\n", node);
+    exit(1);
+  }
+}
+
+// Anonymous mapping of len bytes starting on an align boundary: the slack
+// around the aligned part is unmapped again.
+static void* table_map_aligned(u64 len, u64 align) {
+  u64 span = len + align;
+  char* raw = (char*)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) return NULL;
+  char* table = (char*)round_up((u64)(uintptr_t)raw, align);
+  if (table > raw) munmap(raw, table - raw);
+  if (raw + span > table + len) munmap(table + len, raw + span - (table + len));
+  return table;
+}
+
+void* table_alloc(u64 bytes, const TableAlloc& alloc, TableMem* mem) {
+  void* table = NULL;
+  u64 len = 0;
+  switch (alloc.pages) {
+    case TablePages::DEFAULT:
+      if (alloc.node == TABLE_ANY_NODE) {
+        len = round_up(bytes, 64);
+        table = aligned_alloc(64, len);
+        *mem = TableMem::HEAP;
+        break;
+      }
+      // mbind works on whole pages, the table gets its own.
+      len = round_up(bytes, table_page());
+      table = table_map_aligned(len, table_page());
+      *mem = TableMem::MMAP;
+      break;
+    case TablePages::HUGETLB:
+      len = round_up(bytes, TABLE_HUGE_PAGE);
+      table = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                   (__builtin_ctzll(TABLE_HUGE_PAGE) << MAP_HUGE_SHIFT), -1, 0);
+      *mem = TableMem::HUGE;
+      if (table != MAP_FAILED) break;
+      table = NULL;
+      if (!hugetlb_warned) fprintf(stderr, "No reserved huge pages, using transparent huge pages\n");
+      hugetlb_warned = true;
+      // Fall through.
+    case TablePages::THP:
+      len = round_up(bytes, TABLE_HUGE_PAGE);
+      table = table_map_aligned(len, TABLE_HUGE_PAGE);
+      if (table) madvise(table, len, MADV_HUGEPAGE);
+      *mem = TableMem::HUGE;
+      break;
+  }
+  if (!table) {
+    fprintf(stderr, "Unable to allocate memory for sketch");
+    exit(1);
+  }
+  table_bind(table, len, alloc.node);
+  memset(table, 0, len);
+  return table;
+}
+
+void table_free(void* table, u64 bytes, TableMem mem) {
+  switch (mem) {
+    case TableMem::HEAP: free(table); break;
+    case TableMem::MMAP: munmap(table, round_up(bytes, table_page())); break;
+    case TableMem::HUGE: munmap(table, round_up(bytes, TABLE_HUGE_PAGE)); break;
+  }
+}
+
+u64 table_resident(const void* table, u64 bytes) {
+  if (bytes == 0) return 0;
+  u64 page = table_page();
+  u64 start = (u64)(uintptr_t)table, end = start + bytes;
+  u64 first = start / page * page;
+  u64 pages = (end - first + page - 1) / page;
+  unsigned char vec[4096];
+  u64 resident = 0;
+  for (u64 p = 0; p < pages; p += sizeof(vec)) {
+    u64 n = pages - p < sizeof(vec) ? pages - p : sizeof(vec);
+    if (mincore((void*)(uintptr_t)(first + p * page), n * page, vec) != 0) return bytes;
+    for (u64 i = 0; i < n; ++i) {
+      if (!(vec[i] & 1)) continue;
+      u64 lo = first + (p + i) * page, hi = lo + page;
+      resident += (hi < end ? hi : end) - (lo > start ? lo : start);
+    }
+  }
+  return resident;
+}
+
+u64 table_huge_bytes() {
+  FILE* smaps = fopen("/proc/self/smaps_rollup", "r");
+  if (!smaps) return 0;
+  u64 huge = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), smaps)) {
+    unsigned long kb;
+    if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+        sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1)
+      huge += kb << 10;
+  }
+  fclose(smaps);
+  return huge;
+}
+
+const char* table_pages_name(TablePages pages) {
+  return table_pages_names[(int)pages];
+}
+
+bool table_parse_pages(const char* name, TablePages* pages) {
+  for (int i = 0; i < 3; ++i) {
+    if (strcmp(name, table_pages_names[i]) == 0) {
+      *pages = (TablePages)i;
+      return true;
+    }
+  }
+  return false;
+}
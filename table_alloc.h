@@ -0,0 +1,56 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef _TABLE_ALLOC_H_
+#define _TABLE_ALLOC_H_
+
+#define u64 uint64_t
+
+#ifndef TABLE_HUGE_PAGE
+#define TABLE_HUGE_PAGE (2ULL << 20) // huge page size THP and HUGETLB tables are rounded to
+#endif
+
+#define TABLE_ANY_NODE -1   // no NUMA binding, the kernel's default policy
+#define TABLE_LOCAL_NODE -2 // bind to the node of the allocating thread
+
+// Pages backing a counter table.
+enum class TablePages {
+  DEFAULT, // aligned_alloc, or anonymous 4K pages when bound to a node
+  THP,     // anonymous mapping on a huge page boundary with MADV_HUGEPAGE
+  HUGETLB, // MAP_HUGETLB from the reserved pool, falls back to THP when empty
+};
+
+// How a sketch allocates its counter table(s).
+struct TableAlloc {
+  TablePages pages = TablePages::DEFAULT;
+  int node = TABLE_ANY_NODE; // NUMA node for mbind, or TABLE_ANY_NODE/TABLE_LOCAL_NODE
+};
+
+// How a table was obtained, which decides how it is released.
+enum class TableMem : uint8_t {
+  HEAP,    // aligned_alloc
+  MMAP,    // anonymous or file mapping, page rounded
+  HUGE,    // anonymous or hugetlb mapping, TABLE_HUGE_PAGE rounded
+};
+
+// Zeroed, 64 byte aligned table of bytes bytes placed as alloc asks. The
+// pages are bound (mbind) before they are first touched, so they are
+// faulted in on the requested node. Exits when memory or the node is not
+// available, like the sketches' own allocations.
+void* table_alloc(u64 bytes, const TableAlloc& alloc, TableMem* mem);
+
+void table_free(void* table, u64 bytes, TableMem mem);
+
+// Bytes of the table in resident pages (mincore), the pages straddling its
+// ends counted only for the part inside the table.
+u64 table_resident(const void* table, u64 bytes);
+
+// Bytes of this process's memory backed by huge pages (THP or hugetlb), from
+// /proc/self/smaps_rollup. 0 when unknown.
+u64 table_huge_bytes();
+
+const char* table_pages_name(TablePages pages);
+// "default", "thp" or "hugetlb". False for anything else.
+bool table_parse_pages(const char* name, TablePages* pages);
+
+#endif
@@ -1,28 +1,57 @@
 // Author: Prashant Pandey <prashant.pandey@utah.edu>
 // For use in CS6968 & CS5968
 
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <cassert>
 #include <chrono>
 #include <openssl/rand.h>
+#include <algorithm>
 #include <map>
 #include <unordered_map>
 #include <math.h>
 
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
 #include "zipf.h"
 #include "sketch.h"
+#include "concurrent_sketch.h"
+#include "windowed_sketch.h"
+#include "stream_ingest.h"
+#include "perf_counters.h"
+#include "misra_gries.h"
+#include "table_alloc.h"
 
 using namespace std::chrono;
 
 #define UNIVERSE 1ULL << 30
 #define EXP 1.5
 #define COUNT_ERROR_THRESHOLD 0.01 // Error rate of 1%
+#define WEIGHTED_CHUNK (1 << 16) // items pre-aggregated per weighted micro-batch
+#define DYADIC_RANGES 1000 // random ranges checked against exact counts
+#define DRIFT_XOR 0x5bd1e9955bd1e995ULL // remaps the keys of a drifting stream's second half
+#define HIGH_KEY_BIT (1ULL << 63) // set on every key by --high-keys
 
 double elapsed(high_resolution_clock::time_point t1, high_resolution_clock::time_point t2) {
 	return (duration_cast<duration<double> >(t2 - t1)).count();
 }
 
+// Hardware counts of one phase divided by the items it handled.
+void print_perf(const char* phase, const PerfSample& sample, uint64_t items) {
+	printf("%s:", phase);
+	for (int e = 0; e < PERF_NUM_EVENTS; ++e) {
+		if (sample.values[e] == PERF_UNAVAILABLE) printf("\t %s: n/a", perf_event_name(e));
+		else printf("\t %s: %0.3f", perf_event_name(e), (double)sample.values[e] / items);
+	}
+	if (sample.values[PERF_CYCLES] != PERF_UNAVAILABLE && sample.values[PERF_CYCLES] &&
+			sample.values[PERF_INSTRUCTIONS] != PERF_UNAVAILABLE)
+		printf("\t IPC: %0.2f", (double)sample.values[PERF_INSTRUCTIONS] / sample.values[PERF_CYCLES]);
+	printf("\n");
+}
+
 int main(int argc, char** argv)
 {
 	if (argc < 3) {
@@ -32,29 +61,187 @@ int main(int argc, char** argv)
 	uint64_t N = atoi(argv[1]);
 	double phi = atof(argv[2]);
   SketchType sketch_type = SketchType::MG;
+  SketchConfig config;
+  double epsilon = 0, delta = 0;
+  size_t max_threads = 0;
+  bool roundtrip = false;
+  bool merge = false;
+  bool weighted = false;
+  bool perf = false;
+  bool high_keys = false;
+  bool bits_set = false;
+  const char* input = NULL;
+  const char* dump = NULL;
+  uint64_t stream_seed = time(NULL);
+  uint64_t window = 0;
+  size_t window_buckets = 8;
 
-  if (argc == 4) {
-    if (strncmp(argv[3], "cms", 2) == 0) {
+  if (argc >= 4) {
+    if (strncmp(argv[3], "dcms", 4) == 0) {
+      std::cout << "Sketch Type: Dyadic Count Min Sketch\n";
+      sketch_type = SketchType::DYADIC;
+    } else if (strncmp(argv[3], "cms", 2) == 0) {
       std::cout << "Sketch Type: Count Min Sketch\n";
       sketch_type = SketchType::CMS;
     } else if (strncmp(argv[3], "cs", 2) == 0) {
       std::cout << "Sketch Type: Count Sketch\n";
       sketch_type = SketchType::CS;
+    } else if (strncmp(argv[3], "ss", 2) == 0) {
+      std::cout << "Sketch Type: Space Saving\n";
+      sketch_type = SketchType::SS;
     } else {
       std::cout << "Sketch Type: Misra Gries\n";
       sketch_type = SketchType::MG;
     }
   }
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--hash=double") == 0) {
+      config.hash_mode = HashMode::DOUBLE;
+    } else if (strcmp(argv[i], "--hash=sliced") == 0) {
+      config.hash_mode = HashMode::SLICED;
+    } else if (strcmp(argv[i], "--hash=row") == 0) {
+      config.hash_mode = HashMode::PER_ROW;
+    } else if (strcmp(argv[i], "--mg=map") == 0) {
+      config.mg_backend = MGBackend::MAP;
+    } else if (strcmp(argv[i], "--mg=summary") == 0) {
+      config.mg_backend = MGBackend::SUMMARY;
+    } else if (strcmp(argv[i], "--conservative") == 0) {
+      config.cms_update = CmsUpdate::CONSERVATIVE;
+    } else if (strcmp(argv[i], "--layout=blocked") == 0) {
+      config.cms_layout = CmsLayout::BLOCKED;
+    } else if (strcmp(argv[i], "--layout=rows") == 0) {
+      config.cms_layout = CmsLayout::ROWS;
+    } else if (strcmp(argv[i], "--counters=16") == 0) {
+      config.counters = CounterWidth::BITS16;
+    } else if (strcmp(argv[i], "--counters=32") == 0) {
+      config.counters = CounterWidth::BITS32;
+    } else if (strcmp(argv[i], "--counters=64") == 0) {
+      config.counters = CounterWidth::BITS64;
+    } else if (strcmp(argv[i], "--saturate") == 0) {
+      config.overflow = CounterOverflow::SATURATE;
+    } else if (strncmp(argv[i], "--width=", 8) == 0) {
+      config.width = strtoull(argv[i] + 8, NULL, 10);
+    } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+      config.depth = strtoull(argv[i] + 8, NULL, 10);
+    } else if (strncmp(argv[i], "--bits=", 7) == 0) {
+      config.universe_bits = strtoull(argv[i] + 7, NULL, 10);
+      bits_set = true;
+    } else if (strncmp(argv[i], "--alloc=", 8) == 0) {
+      if (!table_parse_pages(argv[i] + 8, &config.alloc.pages)) {
+        std::cerr << "Unknown allocation " << argv[i] + 8 << "\n";
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--numa=local") == 0) {
+      config.alloc.node = TABLE_LOCAL_NODE;
+    } else if (strncmp(argv[i], "--numa=", 7) == 0) {
+      config.alloc.node = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--epsilon=", 10) == 0) {
+      epsilon = atof(argv[i] + 10);
+    } else if (strncmp(argv[i], "--delta=", 8) == 0) {
+      delta = atof(argv[i] + 8);
+    } else if (strncmp(argv[i], "--window=", 9) == 0) {
+      window = strtoull(argv[i] + 9, NULL, 10);
+    } else if (strncmp(argv[i], "--buckets=", 10) == 0) {
+      window_buckets = strtoull(argv[i] + 10, NULL, 10);
+      if (window_buckets == 0) {
+        std::cerr << "--buckets needs at least one bucket\n";
+        exit(1);
+      }
+    } else if (strncmp(argv[i], "--agg=", 6) == 0) {
+      config.agg_slots = strtoull(argv[i] + 6, NULL, 10);
+    } else if (strncmp(argv[i], "--input=", 8) == 0) {
+      input = argv[i] + 8;
+    } else if (strncmp(argv[i], "--stream-seed=", 14) == 0) {
+      stream_seed = strtoull(argv[i] + 14, NULL, 10);
+    } else if (strncmp(argv[i], "--dump=", 7) == 0) {
+      dump = argv[i] + 7;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      perf = true;
+    } else if (strcmp(argv[i], "--weighted") == 0) {
+      weighted = true;
+    } else if (strcmp(argv[i], "--high-keys") == 0) {
+      high_keys = true;
+    } else if (strcmp(argv[i], "--merge") == 0) {
+      merge = true;
+    } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+      config.seed = strtoull(argv[i] + 7, NULL, 10);
+    } else if (strcmp(argv[i], "--roundtrip") == 0) {
+      roundtrip = true;
+    } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+      max_threads = atoi(argv[i] + 10);
+    } else {
+      std::cerr << "Unknown option " << argv[i] << "\n";
+      exit(1);
+    }
+  }
+  if (epsilon > 0 && delta > 0) {
+    SketchConfig sized = SketchConfig::FromError(epsilon, delta);
+    config.width = sized.width;
+    config.depth = sized.depth;
+    std::cout << "Sketch dimensions: " << config.depth << " x " << config.width << "\n";
+  }
+	high_resolution_clock::time_point t1, t2;
+	if (input) {
+		// Stream a binary log of u64 keys straight into the sketch: no key
+		// array and no exact counts, N only sizes the sketch.
+		Sketch s = Sketch(N, phi, sketch_type, config);
+		IngestStats stats;
+		bool ok = ingest_file(input, [&s](const uint64_t* items, size_t n) {
+			s.AddBatch(items, n);
+		}, &stats);
+		if (!ok) {
+			std::cerr << "Unable to read " << input << "\n";
+			exit(1);
+		}
+		t1 = high_resolution_clock::now();
+		size_t found = s.HeavyHitters(phi).size();
+		t2 = high_resolution_clock::now();
+		std::cout << "Items streamed: " << stats.items << " (" << (stats.mapped ? "mmap" : "read")
+							<< ")\n";
+		std::cout << "Time to stream items into sketch: " << stats.seconds << " secs\n";
+		printf("Ingest throughput: %0.3f GB/s\t %0.2f Mitems/s\n",
+					 stats.bytes / stats.seconds / 1e9, stats.items / stats.seconds / 1e6);
+		std::cout << "Time to compute phi heavy hitters: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Heavy hitters reported: " << found << "\n";
+		printf("Size of Sketch in Bytes: %ld\n", s.Size());
+		return 0;
+	}
 	uint64_t *numbers = (uint64_t *)malloc(N * sizeof(uint64_t));
 	if(!numbers) {
 		std::cerr << "Malloc numbers failed.\n";
 		exit(0);
 	}
-	high_resolution_clock::time_point t1, t2;
 	t1 = high_resolution_clock::now();
-	generate_random_keys(numbers, UNIVERSE, N, EXP);
+	std::cout << "Stream seed: " << stream_seed << "\n";
+	generate_random_keys_seeded(numbers, UNIVERSE, N, EXP, stream_seed, 0);
 	t2 = high_resolution_clock::now();
 	std::cout << "Time to generate " << N << " items: " << elapsed(t1, t2) << " secs\n";
+	if (high_keys) {
+		// Same stream with the top bit set: keys above INT64_MAX must count
+		// exactly like the others.
+		for (uint64_t i = 0; i < N; ++i) numbers[i] |= HIGH_KEY_BIT;
+		std::cout << "High keys: bit 63 set on every key\n";
+	}
+	if (window > 0) {
+		// Drifting stream: same Zipf shape, but the hot keys change half way.
+		for (uint64_t i = N / 2; i < N; ++i) numbers[i] ^= DRIFT_XOR;
+		std::cout << "Drifting stream: keys remapped after item " << N / 2 << "\n";
+	}
+	if (sketch_type == SketchType::DYADIC && !bits_set) {
+		// The generator hashes ranks into 48 bits: levels above the widest key
+		// would only ever count zero prefixes.
+		config.universe_bits = dcms_key_bits(numbers, N);
+		std::cout << "Dyadic key bits: " << config.universe_bits << "\n";
+	}
+	if (dump) {
+		// Raw host order u64 records, the --input format on little-endian hosts.
+		FILE* out = fopen(dump, "wb");
+		if (!out || fwrite(numbers, sizeof(uint64_t), N, out) != N || fclose(out) != 0) {
+			std::cerr << "Unable to write " << dump << "\n";
+			exit(1);
+		}
+		std::cout << "Wrote " << N << " keys to " << dump << "\n";
+	}
 
 	std::unordered_map<uint64_t, uint64_t> map(N);
 
@@ -95,20 +282,383 @@ int main(int argc, char** argv)
 
 	// free(map);
 
-	Sketch s = Sketch(N, phi, sketch_type);
+	Sketch s = Sketch(N, phi, sketch_type, config);
+	PerfCounters pc;
+	PerfSample sample;
+	// Without a PMU only the sketches' own counters are reported.
+	bool hw = perf && perf_open(&pc);
+	if (perf && !hw) std::cout << "Hardware counters unavailable: " << strerror(errno) << "\n";
 
+	if (perf) perf_start(&pc);
 	t1 = high_resolution_clock::now();
 	for (uint64_t i = 0; i < N; ++i) {
 		s.Add(numbers[i]);
 	}
 	t2 = high_resolution_clock::now();
-	std::cout << "Time to stream items into sketch: " << elapsed(t1, t2) << " secs\n";
+	if (perf) perf_stop(&pc, &sample);
+	double stream_time = elapsed(t1, t2);
+	std::cout << "Time to stream items into sketch: " << stream_time << " secs\n";
+	if (perf) {
+		if (hw) print_perf("Add per item", sample, N);
+		// Point queries for every distinct item.
+		uint64_t sink = 0;
+		perf_start(&pc);
+		t1 = high_resolution_clock::now();
+		for (auto it = map.begin(); it != map.end(); ++it) sink += s.Estimate(it->first);
+		t2 = high_resolution_clock::now();
+		perf_stop(&pc, &sample);
+		std::cout << "Time to estimate " << map.size() << " items: " << elapsed(t1, t2)
+							<< " secs (checksum " << sink << ")\n";
+		if (hw) print_perf("Estimate per item", sample, map.size());
+	}
+
+	if (config.agg_slots) {
+		// Same stream without the pre-aggregation buffer in front.
+		SketchConfig plain_config = config;
+		plain_config.agg_slots = 0;
+		Sketch plain = Sketch(N, phi, sketch_type, plain_config);
+		t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < N; ++i) plain.Add(numbers[i]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to stream items into unbuffered sketch: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Aggregation buffer speedup: " << elapsed(t1, t2) / stream_time << "x\n";
+		if ((sketch_type == SketchType::CMS && config.cms_update == CmsUpdate::STANDARD) ||
+				sketch_type == SketchType::CS) {
+			// Linear sketches do not care in which order the counts arrive.
+			bool same = true;
+			for (auto it = map.begin(); it != map.end() && same; ++it)
+				same = s.Estimate(it->first) == plain.Estimate(it->first);
+			std::cout << "Buffered results identical: " << (same ? "yes" : "no") << "\n";
+		}
+	}
+
+	if (sketch_type == SketchType::CMS || sketch_type == SketchType::DYADIC) {
+		// Same stream through the batched update path, must give the same answer.
+		Sketch batched = Sketch(N, phi, sketch_type, config);
+		t1 = high_resolution_clock::now();
+		batched.AddBatch(numbers, N);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to batch stream items into sketch: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Batch speedup: " << stream_time / elapsed(t1, t2) << "x\n";
+		bool same = true;
+		for (uint64_t i = 0; i < N && same; i += 997)
+			same = s.Estimate(numbers[i]) == batched.Estimate(numbers[i]);
+		same = same && s.HeavyHitters(phi) == batched.HeavyHitters(phi);
+		std::cout << "Batch results identical: " << (same ? "yes" : "no") << "\n";
+	}
+	if (sketch_type == SketchType::DYADIC) {
+		// What the extra levels cost per update against a plain CMS of the
+		// same dimensions, heap included.
+		Sketch flat = Sketch(N, phi, SketchType::CMS, config);
+		t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < N; ++i) flat.Add(numbers[i]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to stream items into flat CMS: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Dyadic update cost vs CMS: " << stream_time / elapsed(t1, t2) << "x\n";
+		std::cout << "Dyadic items rejected: " << s.Counters().dyadic_rejected << "\n";
+
+		// Ranges between random stream items against exact prefix sums.
+		std::vector<std::pair<uint64_t, uint64_t> > sorted(map.begin(), map.end());
+		std::sort(sorted.begin(), sorted.end());
+		std::vector<uint64_t> prefix(sorted.size() + 1, 0);
+		for (size_t i = 0; i < sorted.size(); ++i) prefix[i + 1] = prefix[i] + sorted[i].second;
+		auto rank = [&sorted, &prefix](uint64_t x) { // items <= x
+			auto it = std::upper_bound(sorted.begin(), sorted.end(), std::make_pair(x, UINT64_MAX));
+			return prefix[it - sorted.begin()];
+		};
+		double range_err = 0;
+		uint64_t under = 0;
+		t1 = high_resolution_clock::now();
+		for (uint64_t r = 0; r < DYADIC_RANGES; ++r) {
+			uint64_t lo = numbers[(r * 7919) % N], hi = numbers[(r * 104729 + 1) % N];
+			if (lo > hi) std::swap(lo, hi);
+			uint64_t exact = rank(hi) - (lo ? rank(lo - 1) : 0);
+			uint64_t est = s.RangeEstimate(lo, hi);
+			under += est < exact;
+			range_err += est - (double)exact;
+		}
+		t2 = high_resolution_clock::now();
+		std::cout << "Time per range query: " << elapsed(t1, t2) / DYADIC_RANGES * 1e9 << " ns\n";
+		printf("Mean range overestimate: %0.2f (%0.5f of N)\t Underestimates: %lu\n",
+					 range_err / DYADIC_RANGES, range_err / DYADIC_RANGES / N, under);
+		const double qs[] = {0.25, 0.5, 0.75, 0.99};
+		for (double q : qs)
+			printf("Quantile %0.2f: %lu\t true rank: %0.4f\n", q, s.Quantile(q),
+						 (double)rank(s.Quantile(q)) / N);
+	}
+	if (config.counters != CounterWidth::BITS64 &&
+			(sketch_type == SketchType::CMS || sketch_type == SketchType::CS)) {
+		// Same stream with 64 bit counters: what the narrow table gains in speed
+		// and loses in accuracy (saturated counters).
+		SketchConfig wide_config = config;
+		wide_config.counters = CounterWidth::BITS64;
+		Sketch wide = Sketch(N, phi, sketch_type, wide_config);
+		t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < N; ++i) wide.Add(numbers[i]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to stream items into 64-bit counter sketch: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Narrow counter speedup: " << elapsed(t1, t2) / stream_time << "x\n";
+		uint64_t sampled = 0, differ = 0;
+		for (uint64_t i = 0; i < N; i += 997, ++sampled)
+			differ += s.Estimate(numbers[i]) != wide.Estimate(numbers[i]);
+		std::cout << "Estimates differing from 64-bit counters: " << differ << " of " << sampled << "\n";
+		uint64_t wide_size = wide.Size();
+		std::cout << "64-bit counter sketch size: " << wide_size << " bytes\n";
+	}
+	if (sketch_type == SketchType::CMS && config.cms_layout == CmsLayout::BLOCKED) {
+		// Same stream on the classic one-counter-per-row layout.
+		SketchConfig rows_config = config;
+		rows_config.cms_layout = CmsLayout::ROWS;
+		Sketch rows = Sketch(N, phi, sketch_type, rows_config);
+		t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < N; ++i) rows.Add(numbers[i]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to stream items into row layout sketch: " << elapsed(t1, t2) << " secs\n";
+		std::cout << "Blocked layout speedup: " << elapsed(t1, t2) / stream_time << "x\n";
+		// Mean overestimate per distinct item, both layouts only ever overcount.
+		double blocked_err = 0, rows_err = 0;
+		for (auto it = map.begin(); it != map.end(); ++it) {
+			blocked_err += s.Estimate(it->first) - it->second;
+			rows_err += rows.Estimate(it->first) - it->second;
+		}
+		printf("Mean overestimate blocked: %0.3f\t rows: %0.3f\n",
+					 blocked_err / map.size(), rows_err / map.size());
+	}
+	if (max_threads > 0 && (sketch_type == SketchType::CMS || sketch_type == SketchType::CS)) {
+		// Throughput scaling of the thread sharded sketch, 1 .. max_threads.
+		double single = 0;
+		for (size_t threads = 1; threads <= max_threads;) {
+			ConcurrentSketch cs(N, phi, sketch_type, threads, config);
+			std::vector<std::thread> workers;
+			uint64_t chunk = (N + threads - 1) / threads;
+			t1 = high_resolution_clock::now();
+			for (size_t t = 0; t < threads; ++t) {
+				uint64_t start = std::min<uint64_t>(N, t * chunk);
+				uint64_t len = std::min<uint64_t>(N - start, chunk);
+				workers.emplace_back([&cs, t, numbers, start, len] {
+					cs.AddBatch(t, numbers + start, len);
+				});
+			}
+			cs.HeavyHitters(phi); // query while ingest is running
+			for (auto& w : workers) w.join();
+			t2 = high_resolution_clock::now();
+			double secs = elapsed(t1, t2);
+			if (threads == 1) single = secs;
+			size_t found = cs.HeavyHitters(phi).size();
+			printf("Threads: %zu\t Throughput: %0.2f Mitems/s\t Scaling: %0.2fx\t Heavy hitters: %zu\n",
+						 threads, N / secs / 1e6, single / secs, found);
+			if (threads == max_threads) break;
+			threads = std::min(threads * 2, max_threads);
+		}
+	}
+	if (max_threads > 0 && sketch_type == SketchType::MG) {
+		// Parallel ingest: one summary per thread over a slice of the stream,
+		// merged at the end. The merged summary must still satisfy
+		// f - N/(k2+1) <= estimate <= f for every item.
+		std::vector<MisraGries*> parts(max_threads);
+		std::vector<std::thread> workers;
+		uint64_t chunk = (N + max_threads - 1) / max_threads;
+		for (size_t t = 0; t < max_threads; ++t) parts[t] = mg_init(N, phi, config.mg_backend);
+		t1 = high_resolution_clock::now();
+		for (size_t t = 0; t < max_threads; ++t) {
+			uint64_t start = std::min<uint64_t>(N, t * chunk);
+			uint64_t end = std::min<uint64_t>(N, start + chunk);
+			workers.emplace_back([&parts, t, numbers, start, end] {
+				for (uint64_t i = start; i < end; ++i) mg_add(parts[t], numbers[i]);
+			});
+		}
+		for (auto& w : workers) w.join();
+		high_resolution_clock::time_point t3 = high_resolution_clock::now();
+		for (size_t t = 1; t < max_threads; ++t) mg_merge(parts[0], parts[t]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to ingest with " << max_threads << " threads: " << elapsed(t1, t3)
+							<< " secs, merge: " << elapsed(t3, t2) << " secs\n";
+
+		double bound = (double)N / (parts[0]->k2 + 1);
+		uint64_t violations = 0;
+		for (auto it = map.begin(); it != map.end(); ++it) {
+			double est = mg_estimate(parts[0], it->first);
+			if (est > it->second || it->second - est > bound) violations++;
+		}
+		printf("Merged MG error bound N/(k2+1): %0.2f\t Violations: %lu\n", bound, violations);
+		for (size_t t = 0; t < max_threads; ++t) mg_free(parts[t]);
+	}
+	if (merge && (sketch_type == SketchType::CMS || sketch_type == SketchType::CS ||
+								sketch_type == SketchType::DYADIC)) {
+		// Two halves of the stream sketched apart and merged must equal the
+		// sketch of the whole stream, and whole minus first half the second half.
+		// Holds for linear updates, not for --conservative or saturated counters.
+		uint64_t half = N / 2;
+		Sketch first = Sketch(N, phi, sketch_type, config);
+		Sketch second = Sketch(N, phi, sketch_type, config);
+		first.AddBatch(numbers, half);
+		second.AddBatch(numbers + half, N - half);
+		Sketch merged = Sketch(N, phi, sketch_type, config);
+		t1 = high_resolution_clock::now();
+		bool ok = merged.Merge(first) && merged.Merge(second);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to merge two sketches: " << elapsed(t1, t2) / 2 << " secs\n";
+		Sketch delta = Sketch(N, phi, sketch_type, config);
+		delta.Merge(s);
+		t1 = high_resolution_clock::now();
+		ok = ok && delta.Subtract(first);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to subtract a sketch: " << elapsed(t1, t2) << " secs\n";
+		bool merged_same = ok, delta_same = ok;
+		for (auto it = map.begin(); it != map.end(); ++it) {
+			merged_same = merged_same && merged.Estimate(it->first) == s.Estimate(it->first);
+			delta_same = delta_same && delta.Estimate(it->first) == second.Estimate(it->first);
+		}
+		std::cout << "Merged results identical: " << (merged_same ? "yes" : "no") << "\n";
+		std::cout << "Subtracted results identical: " << (delta_same ? "yes" : "no") << "\n";
+		size_t found = 0;
+		for (const auto& hh : merged.HeavyHitters(phi)) found += topK.count(hh.first);
+		std::cout << "Merged heavy hitters found: " << found << " of " << topK.size() << "\n";
+	}
+	if (weighted) {
+		// Pre-aggregate the stream in micro-batches of WEIGHTED_CHUNK items and
+		// feed one weighted update per distinct item. Linear sketches must end
+		// up with the same counters as the unit stream.
+		std::vector<uint64_t> items, weights;
+		std::unordered_map<uint64_t, uint64_t> batch;
+		Sketch ws = Sketch(N, phi, sketch_type, config);
+		double aggregate_time = 0, update_time = 0;
+		uint64_t distinct = 0;
+		for (uint64_t start = 0; start < N; start += WEIGHTED_CHUNK) {
+			uint64_t end = std::min<uint64_t>(N, start + WEIGHTED_CHUNK);
+			t1 = high_resolution_clock::now();
+			batch.clear();
+			for (uint64_t i = start; i < end; ++i) batch[numbers[i]]++;
+			items.clear();
+			weights.clear();
+			for (const auto& pair : batch) {
+				items.push_back(pair.first);
+				weights.push_back(pair.second);
+			}
+			t2 = high_resolution_clock::now();
+			aggregate_time += elapsed(t1, t2);
+			ws.AddBatch(items.data(), items.size(), weights.data());
+			update_time += elapsed(t2, high_resolution_clock::now());
+			distinct += items.size();
+		}
+		std::cout << "Weighted updates: " << distinct << " for " << N << " items\n";
+		std::cout << "Time to pre-aggregate: " << aggregate_time << " secs, weighted updates: "
+							<< update_time << " secs\n";
+		std::cout << "Weighted update speedup: " << stream_time / update_time << "x\n";
+		if (sketch_type == SketchType::CMS || sketch_type == SketchType::CS) {
+			bool same = true;
+			for (auto it = map.begin(); it != map.end() && same; ++it)
+				same = s.Estimate(it->first) == ws.Estimate(it->first);
+			std::cout << "Weighted results identical: " << (same ? "yes" : "no") << "\n";
+
+			// Turnstile: take the first half back out with negative deltas, what
+			// remains must be the sketch of the second half.
+			uint64_t half = N / 2;
+			std::unordered_map<uint64_t, uint64_t> first;
+			for (uint64_t i = 0; i < half; ++i) first[numbers[i]]++;
+			Sketch second = Sketch(N, phi, sketch_type, config);
+			second.AddBatch(numbers + half, N - half);
+			bool ok = true;
+			t1 = high_resolution_clock::now();
+			for (const auto& pair : first) ok = ws.Update(pair.first, -(int64_t)pair.second) && ok;
+			t2 = high_resolution_clock::now();
+			std::cout << "Time to delete the first half: " << elapsed(t1, t2) << " secs\n";
+			for (auto it = map.begin(); it != map.end() && ok; ++it)
+				ok = ws.Estimate(it->first) == second.Estimate(it->first);
+			std::cout << "Turnstile results identical: " << (ok ? "yes" : "no") << "\n";
+		} else {
+			size_t found = 0;
+			for (const auto& hh : ws.HeavyHitters(phi)) found += topK.count(hh.first);
+			std::cout << "Weighted heavy hitters found: " << found << " of " << topK.size() << "\n";
+		}
+	}
+	if (window > 0 && (sketch_type == SketchType::CMS || sketch_type == SketchType::CS ||
+										 sketch_type == SketchType::MG)) {
+		uint64_t bucket_events = (window + window_buckets - 1) / window_buckets;
+		WindowedSketch ws(N, phi, sketch_type, window_buckets, bucket_events, config);
+		t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < N; ++i) ws.Add(numbers[i]);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to stream items into windowed sketch: " << elapsed(t1, t2) << " secs\n";
+
+		// Exact heavy hitters of the items the window holds right now.
+		uint64_t in_window = ws.WindowCount();
+		std::unordered_map<uint64_t, uint64_t> window_counts;
+		for (uint64_t i = N - in_window; i < N; ++i) window_counts[numbers[i]]++;
+		std::unordered_map<uint64_t, uint64_t> window_topK;
+		for (auto it = window_counts.begin(); it != window_counts.end(); ++it)
+			if (it->second >= phi * in_window) window_topK.insert(*it);
+
+		double wtp = 0;
+		std::multimap<uint64_t, uint64_t, std::greater<uint64_t> > window_hh = ws.HeavyHitters(phi);
+		for (const auto& hh : window_hh) wtp += window_topK.count(hh.first);
+		uint64_t stale = 0;
+		std::multimap<uint64_t, uint64_t, std::greater<uint64_t> > whole_hh = s.HeavyHitters(phi);
+		for (const auto& hh : whole_hh) stale += !window_topK.count(hh.first);
+		printf("Window items: %lu\t Window heavy hitters: %zu\t Reported: %zu\n",
+					 in_window, window_topK.size(), window_hh.size());
+		printf("Window precision: %0.02f percent\t Window recall: %0.02f percent\n",
+					 window_hh.empty() ? 0 : wtp / window_hh.size() * 100,
+					 window_topK.empty() ? 0 : wtp / window_topK.size() * 100);
+		printf("Whole stream heavy hitters not heavy in the window: %lu of %zu\n",
+					 stale, whole_hh.size());
+		printf("Size of windowed sketch in Bytes: %lu\n", ws.Size());
+	}
+	if (roundtrip) {
+		// Serialize, load back and check every item's estimate.
+		char path[] = "/tmp/sketchXXXXXX";
+		int fd = mkstemp(path);
+		if (fd < 0) {
+			std::cerr << "Unable to create a temporary file.\n";
+			exit(1);
+		}
+		t1 = high_resolution_clock::now();
+		bool written = s.Serialize(fd);
+		t2 = high_resolution_clock::now();
+		off_t bytes = lseek(fd, 0, SEEK_CUR);
+		close(fd);
+		std::cout << "Time to serialize " << bytes << " bytes: " << elapsed(t1, t2) << " secs\n";
+		t1 = high_resolution_clock::now();
+		Sketch loaded = Sketch::Load(path);
+		t2 = high_resolution_clock::now();
+		std::cout << "Time to load sketch: " << elapsed(t1, t2) << " secs\n";
+		bool same = written;
+		for (auto it = map.begin(); it != map.end() && same; ++it)
+			same = s.Estimate(it->first) == loaded.Estimate(it->first);
+		// MG/SS pick among tied counts by container order, which a reload
+		// changes, equal estimates already pin down their state.
+		if (sketch_type == SketchType::CMS || sketch_type == SketchType::CS)
+			same = same && s.HeavyHitters(phi) == loaded.HeavyHitters(phi);
+		std::cout << "Round trip results identical: " << (same ? "yes" : "no") << "\n";
+		unlink(path);
+	}
 	free(numbers); // free stream
 
+	if (perf) perf_start(&pc);
 	t1 = high_resolution_clock::now();
 	std::multimap<uint64_t, uint64_t, std::greater<uint64_t> > sketch_topK = s.HeavyHitters(phi);
 	t2 = high_resolution_clock::now();
 	std::cout << "Time to compute phi heavy hitters: " << elapsed(t1, t2) << " secs\n";
+	if (perf) {
+		perf_stop(&pc, &sample);
+		if (hw) print_perf("HeavyHitters per call", sample, 1);
+		perf_close(&pc);
+		SketchCounters c = s.Counters();
+		printf("Heap sift steps: %lu\t Heap evictions: %lu\t MG decrement sweeps: %lu\t"
+					 " Map rehashes: %lu\n", c.heap_sifts, c.heap_evictions, c.mg_decrements,
+					 c.map_rehashes);
+	}
+	{
+		// Same query into a caller buffer, now answered from the cache.
+		std::vector<HeapElement> hh(sketch_topK.size() + 1);
+		const int reps = 1000;
+		size_t found = 0;
+		t1 = high_resolution_clock::now();
+		for (int r = 0; r < reps; ++r) found = s.HeavyHitters(phi, hh.data(), hh.size());
+		t2 = high_resolution_clock::now();
+		std::cout << "Cached heavy hitter query: " << elapsed(t1, t2) / reps * 1e9 << " ns, "
+							<< found << " items\n";
+	}
 
     double tp = 0, fp = 0, fn = 0;
 
@@ -0,0 +1,210 @@
+#include "windowed_sketch.h"
+#include "count_min_sketch.h"
+#include "count_sketch.h"
+#include "min_heap.h"
+#include "misra_gries.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Adds between clock reads for time based buckets.
+#ifndef WINDOW_CLOCK_EVERY
+#define WINDOW_CLOCK_EVERY 64
+#endif
+
+WindowedSketch::WindowedSketch(u64 N, double phi, SketchType type, size_t buckets,
+                               u64 bucket_events, const SketchConfig& config, u64 bucket_ms)
+    : current(0), aggregate(nullptr), merge_scratch(nullptr), type(type),
+      bucket_events(bucket_ms ? 0 : bucket_events), bucket_ms(bucket_ms), bucket_start(std::chrono::steady_clock::now()), since_clock(0) {
+  if (buckets == 0 || (bucket_events == 0 && bucket_ms == 0)) {
+    fprintf(stderr, "WindowedSketch needs at least one bucket of non zero length\n");
+    exit(1);
+  }
+  // Only standard updates and promoted counters can be subtracted.
+  SketchConfig subtractable = config;
+  subtractable.cms_update = CmsUpdate::STANDARD;
+  subtractable.overflow = CounterOverflow::PROMOTE;
+  switch(type) {
+    case SketchType::CMS:
+    case SketchType::CS: aggregate = make_backend(type, N, phi, subtractable); break;
+    case SketchType::MG: merge_scratch = make_backend(type, N, phi, config); break;
+    default:
+      fprintf(stderr, "WindowedSketch only supports CMS, CS and MG\n");
+      exit(1);
+  }
+  for (size_t b = 0; b < buckets; ++b) {
+    Bucket bucket = {nullptr, 0};
+    switch(type) {
+      case SketchType::CMS:
+        bucket.backend = cms_init_like(static_cast<CountMinSketch*>(aggregate));
+        break;
+      case SketchType::CS:
+        bucket.backend = cs_init_like(static_cast<CountSketch*>(aggregate));
+        break;
+      case SketchType::MG: bucket.backend = make_backend(type, N, phi, config); break;
+      default: break;
+    }
+    ring.push_back(bucket);
+  }
+}
+
+// Starts a new bucket in the oldest slot, taking the oldest one's counts out
+// of the window.
+void WindowedSketch::Rotate() {
+  current = (current + 1) % ring.size();
+  Bucket& b = ring[current];
+  if (b.count > 0) {
+    switch(type) {
+      case SketchType::CMS: {
+        CountMinSketch* expired = static_cast<CountMinSketch*>(b.backend);
+        cms_subtract(static_cast<CountMinSketch*>(aggregate), expired);
+        cms_clear(expired);
+        break;
+      }
+      case SketchType::CS: {
+        CountSketch* expired = static_cast<CountSketch*>(b.backend);
+        cs_subtract(static_cast<CountSketch*>(aggregate), expired);
+        cs_clear(expired);
+        break;
+      }
+      case SketchType::MG: mg_clear(static_cast<MisraGries*>(b.backend)); break;
+      default: break;
+    }
+  }
+  b.count = 0;
+}
+
+// Rotates past every time based bucket that has ended, at most a full ring.
+void WindowedSketch::Advance() {
+  if (bucket_ms == 0) return;
+  since_clock = 0;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::chrono::milliseconds length(bucket_ms);
+  // After a long idle gap every bucket has expired, the ring is cleared at
+  // most once.
+  u64 ended = (now - bucket_start) / length;
+  for (u64 r = 0; r < ended && r < ring.size(); ++r) Rotate();
+  bucket_start += ended * length;
+}
+
+void WindowedSketch::Add(u64 item, u64 weight) {
+  if (bucket_ms && ++since_clock >= WINDOW_CLOCK_EVERY) Advance();
+  Bucket& b = ring[current];
+  switch(type) {
+    case SketchType::CMS:
+      cms_add(static_cast<CountMinSketch*>(b.backend), item, weight);
+      cms_add(static_cast<CountMinSketch*>(aggregate), item, weight);
+      break;
+    case SketchType::CS:
+      cs_add(static_cast<CountSketch*>(b.backend), item, weight);
+      cs_add(static_cast<CountSketch*>(aggregate), item, weight);
+      break;
+    case SketchType::MG: mg_add(static_cast<MisraGries*>(b.backend), item, weight); break;
+    default: break;
+  }
+  b.count += weight;
+  if (bucket_events && b.count >= bucket_events) Rotate();
+}
+
+u64 WindowedSketch::Estimate(u64 item) {
+  Advance();
+  switch(type) {
+    case SketchType::CMS: return cms_estimate(static_cast<CountMinSketch*>(aggregate), item);
+    case SketchType::CS:  return cs_estimate(static_cast<CountSketch*>(aggregate), item);
+    case SketchType::MG: {
+      // Every bucket under counts by at most its own error, so does the sum.
+      u64 total = 0;
+      for (Bucket& b : ring) total += mg_estimate(static_cast<MisraGries*>(b.backend), item);
+      return total;
+    }
+    default: break;
+  }
+  return 0;
+}
+
+u64 WindowedSketch::WindowCount() {
+  Advance();
+  u64 total = 0;
+  for (const Bucket& b : ring) total += b.count;
+  return total;
+}
+
+u64 WindowedSketch::Size() {
+  u64 total = sizeof(*this) + ring.size() * sizeof(Bucket);
+  switch(type) {
+    // cms_size/cs_size print a line per call, add up their quiet parts.
+    case SketchType::CMS: {
+      CountMinSketch* agg = static_cast<CountMinSketch*>(aggregate);
+      total += cms_table_size(agg) + agg->heap->size();
+      for (Bucket& b : ring) {
+        CountMinSketch* cms = static_cast<CountMinSketch*>(b.backend);
+        total += cms_table_size(cms) + cms->heap->size();
+      }
+      break;
+    }
+    case SketchType::CS: {
+      CountSketch* agg = static_cast<CountSketch*>(aggregate);
+      total += cs_table_size(agg) + agg->heap->size();
+      for (Bucket& b : ring) {
+        CountSketch* cs = static_cast<CountSketch*>(b.backend);
+        total += cs_table_size(cs) + cs->heap->size();
+      }
+      break;
+    }
+    case SketchType::MG:
+      total += mg_size(static_cast<MisraGries*>(merge_scratch));
+      for (Bucket& b : ring) total += mg_size(static_cast<MisraGries*>(b.backend));
+      break;
+    default: break;
+  }
+  return total;
+}
+
+std::multimap<u64, u64, std::greater<u64>> WindowedSketch::HeavyHitters(double phi) {
+  std::multimap<u64, u64, std::greater<u64>> topK;
+  u64 count = WindowCount();
+  double threshold = phi * count;
+  std::vector<std::pair<u64, u64>> pairs;
+  switch(type) {
+    case SketchType::CMS:
+    case SketchType::CS: {
+      MinHeap* heap = type == SketchType::CMS ? static_cast<CountMinSketch*>(aggregate)->heap
+                                              : static_cast<CountSketch*>(aggregate)->heap;
+      for (const HeapElement& e : heap->getTopK()) pairs.push_back({e.item, e.count});
+      break;
+    }
+    case SketchType::MG: {
+      MisraGries* merged = static_cast<MisraGries*>(merge_scratch);
+      mg_clear(merged);
+      for (Bucket& b : ring) {
+        if (b.count > 0) mg_merge(merged, static_cast<MisraGries*>(b.backend));
+      }
+      mg_collect(merged, &pairs);
+      // As in Sketch::HeavyHitters: the merged summary under counts by at
+      // most count / (k2 + 1), so no true heavy hitter is missed.
+      threshold -= (double)count / (merged->k2 + 1);
+      break;
+    }
+    default: break;
+  }
+  for (const auto& pair : pairs) {
+    if (pair.second >= threshold) topK.insert({pair.first, pair.second});
+  }
+  return topK;
+}
+
+WindowedSketch::~WindowedSketch() {
+  for (Bucket& b : ring) {
+    switch(type) {
+      case SketchType::CMS: cms_free(static_cast<CountMinSketch*>(b.backend)); break;
+      case SketchType::CS:  cs_free(static_cast<CountSketch*>(b.backend)); break;
+      case SketchType::MG:  mg_free(static_cast<MisraGries*>(b.backend)); break;
+      default: break;
+    }
+  }
+  switch(type) {
+    case SketchType::CMS: cms_free(static_cast<CountMinSketch*>(aggregate)); break;
+    case SketchType::CS:  cs_free(static_cast<CountSketch*>(aggregate)); break;
+    case SketchType::MG:  mg_free(static_cast<MisraGries*>(merge_scratch)); break;
+    default: break;
+  }
+}
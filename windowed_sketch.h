@@ -0,0 +1,60 @@
+#ifndef WINDOWED_SKETCH_H
+#define WINDOWED_SKETCH_H
+
+#include "sketch.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+// Heavy hitters over the most recent part of the stream. The stream is cut
+// into buckets of bucket_events items (or bucket_ms milliseconds), the last
+// `buckets` of them, the newest one still filling, form the window.
+//
+// Every bucket has its own sketch. CMS/CS also keep an aggregate of the whole
+// window, updated with every item; an expiring bucket's table is subtracted
+// from it in O(width * depth), so queries never rescan the ring. CMS always
+// uses standard updates and promoting counters here, conservative updates and
+// saturated counters can not be subtracted. MG summaries can not be
+// subtracted at all and are merged at query time instead.
+class WindowedSketch {
+private:
+    struct Bucket {
+        void* backend;
+        u64 count; // items in this bucket
+    };
+
+    std::vector<Bucket> ring;
+    size_t current;
+    void* aggregate; // CMS/CS only, sum of every bucket
+    void* merge_scratch; // MG only, the buckets merged by HeavyHitters
+    SketchType type;
+
+    u64 bucket_events; // 0 when buckets are time based
+    u64 bucket_ms;
+    std::chrono::steady_clock::time_point bucket_start;
+    u64 since_clock; // adds since the clock was last read
+
+    void Rotate();
+    void Advance();
+
+public:
+    // A window of buckets * bucket_events items, or when bucket_ms > 0 of
+    // buckets * bucket_ms milliseconds (bucket_events is then ignored).
+    WindowedSketch(u64 N, double phi, SketchType type, size_t buckets, u64 bucket_events,
+                   const SketchConfig& config = SketchConfig(), u64 bucket_ms = 0);
+    WindowedSketch(const WindowedSketch&) = delete;
+    WindowedSketch& operator=(const WindowedSketch&) = delete;
+    // Weighted adds count weight items towards bucket_events.
+    void Add(u64 item, u64 weight = 1);
+    u64 Estimate(u64 item);
+    // Items currently inside the window.
+    u64 WindowCount();
+    u64 Size();
+    // Items estimated at >= phi * WindowCount().
+    std::multimap<u64, u64, std::greater<u64>> HeavyHitters(double phi);
+    ~WindowedSketch();
+};
+
+#endif
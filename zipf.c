@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "hashutil.h"
 
@@ -69,11 +71,8 @@ ZIPFIAN create_zipfian (double s, long N, long int (*randomfun)(void)) {
 	z->randomfun = randomfun;
 
 	// Calculate the total probability distribution
-	double H_Ns = 0;
+	double H_Ns = zipf_harmonic(N, s);
 	long i = 0;
-	for (i=0; i<N; i++) {
-		H_Ns += pow(i+1, -s);
-	}
 
 	// For the first half of the pairs do things exactly
 	double cumulative = 0;
@@ -154,30 +153,152 @@ void destroy_zipfian (ZIPFIAN z) {
 	free((struct zipfian *)z);
 }
 
-void generate_random_keys (uint64_t *elems, long N, long gencount, double s) {
-	__uint128_t range = 1ULL << 48;
-	uint32_t seed = time(NULL);
-	int i;
-	uint32_t *counts;
+// Terms of H_{N,s} summed exactly before the Euler-Maclaurin tail.
+#ifndef ZIPF_EXACT_TERMS
+#define ZIPF_EXACT_TERMS 16
+#endif
+
+double zipf_harmonic (long N, double s) {
+	double H = 0;
+	long n;
+	long exact = N < ZIPF_EXACT_TERMS ? N : ZIPF_EXACT_TERMS;
+	for (n=1; n<=exact; n++) H += pow(n, -s);
+	if (N <= exact) return H;
+	// Tail sum_{n=m}^{N} f(n) with f(x) = x^{-s}: the integral, the end point
+	// average and the f' and f''' corrections. The next term is O(m^{-s-5}).
+	double m = exact + 1, last = N;
+	double integral = fabs(s - 1) < 1e-12 ? log(last / m)
+	                                      : (pow(last, 1 - s) - pow(m, 1 - s)) / (1 - s);
+	H += integral + (pow(m, -s) + pow(last, -s)) / 2;
+	H += s / 12 * (pow(m, -s - 1) - pow(last, -s - 1));
+	H -= s * (s + 1) * (s + 2) / 720 * (pow(m, -s - 3) - pow(last, -s - 3));
+	return H;
+}
+
+// Rejection-inversion sampling (Hoermann and Derflinger 1996): invert the
+// integral H of the hat function x^{-s} and accept the rounded result with a
+// cheap test, the expected number of rounds is close to one.
+struct zipf_ri {
+	double s;
+	long N;
+	double h_x1;        // H(1.5) - 1
+	double h_n;         // H(N + 0.5)
+	double threshold;   // 2 - H^{-1}(H(2.5) - h(2))
+};
+
+// log1p(x)/x and expm1(x)/x, with their Taylor series near zero.
+static double zipf_helper1 (double x) {
+	if (fabs(x) > 1e-8) return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2 (double x) {
+	if (fabs(x) > 1e-8) return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x));
+}
+
+static double zipf_h (const struct zipf_ri *z, double x) {
+	return exp(-z->s * log(x));
+}
+
+static double zipf_h_integral (const struct zipf_ri *z, double x) {
+	double log_x = log(x);
+	return zipf_helper2((1 - z->s) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse (const struct zipf_ri *z, double x) {
+	double t = x * (1 - z->s);
+	if (t < -1) t = -1; // rounding, H^{-1} is only defined down to here
+	return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_ri_init (struct zipf_ri *z, double s, long N) {
+	z->s = s;
+	z->N = N;
+	z->h_x1 = zipf_h_integral(z, 1.5) - 1;
+	z->h_n = zipf_h_integral(z, N + 0.5);
+	z->threshold = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+// splitmix64 step. The state only ever advances by a constant and every
+// output is a mix of it, so a stream is fully keyed by its start.
+static uint64_t zipf_next (uint64_t *state) {
+	uint64_t x = (*state += 0x9E3779B97F4A7C15ULL);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Rank in [0, N), 0 the most frequent.
+static long zipf_ri_sample (const struct zipf_ri *z, uint64_t *state) {
+	while (1) {
+		double u01 = (zipf_next(state) >> 11) * (1.0 / 9007199254740992.0); // 53 bits
+		double u = z->h_n + u01 * (z->h_x1 - z->h_n);
+		double x = zipf_h_integral_inverse(z, u);
+		long k = (long)(x + 0.5);
+		if (k < 1) k = 1;
+		else if (k > z->N) k = z->N;
+		if (k - x <= z->threshold || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+			return k - 1;
+	}
+}
+
+struct zipf_job {
+	uint64_t *elems;
+	long begin, end;
+	const struct zipf_ri *z;
+	uint64_t seed;
+};
+
+static void *zipf_fill (void *arg) {
+	const struct zipf_job *job = (const struct zipf_job *)arg;
+	const uint64_t range = 1ULL << 48;
+	unsigned int hash_seed = (unsigned int)(job->seed ^ (job->seed >> 32));
+	long i;
+	for (i=job->begin; i<job->end; i++) {
+		// Item i's own stream, whichever thread draws it.
+		uint64_t state = job->seed ^ ((uint64_t)i * 0xD1B54A32D192ED03ULL);
+		long g = zipf_ri_sample(job->z, &state);
+		job->elems[i] = MurmurHash64A(&g, sizeof(g), hash_seed) % range;
+	}
+	return NULL;
+}
+
+void generate_random_keys_seeded (uint64_t *elems, long N, long gencount, double s,
+                                  uint64_t seed, int threads) {
+	assert(s > 0);
+	assert(0 < N);
 	printf("Generating %ld elements in universe of %ld items with characteristic exponent %f\n",
 				 gencount, N, s);
-	ZIPFIAN z = create_zipfian(s, N, RFUN);
-	counts = (uint32_t*)calloc(N, sizeof(counts));
-
-	for (i=0; i<gencount; i++) {
-		long g = zipfian_gen(z);
-		assert(0<=g && g<N);
-		counts[g]++;
-		g = MurmurHash64A( ((void*)&g), sizeof(g), seed);
-		elems[i] = g % range;
-	}
-	if (0) {
-		for (i=0; i<N; i++) {
-			printf("%4.1f (%4.1f)\n", counts[0]/(double)counts[i],
-						 i/(counts[0]/(double)counts[i]));
+	struct zipf_ri z;
+	zipf_ri_init(&z, s, N);
+	if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	if (gencount < threads) threads = gencount > 0 ? gencount : 1;
+
+	struct zipf_job *jobs = (struct zipf_job *)malloc(threads * sizeof(*jobs));
+	pthread_t *tids = (pthread_t *)malloc(threads * sizeof(*tids));
+	assert(jobs && tids);
+	long chunk = (gencount + threads - 1) / threads;
+	int t;
+	for (t=0; t<threads; t++) {
+		jobs[t].elems = elems;
+		jobs[t].begin = t * chunk < gencount ? t * chunk : gencount;
+		jobs[t].end = gencount - jobs[t].begin > chunk ? jobs[t].begin + chunk : gencount;
+		jobs[t].z = &z;
+		jobs[t].seed = seed;
+		// The calling thread fills the first slice itself.
+		if (t > 0 && pthread_create(&tids[t], NULL, zipf_fill, &jobs[t]) != 0) {
+			fprintf(stderr, "Unable to start generator thread\n");
+			exit(1);
 		}
-		printf("\n");
 	}
-	destroy_zipfian(z);
+	zipf_fill(&jobs[0]);
+	for (t=1; t<threads; t++) pthread_join(tids[t], NULL);
+	free(jobs);
+	free(tids);
 }
 
+void generate_random_keys (uint64_t *elems, long N, long gencount, double s) {
+	generate_random_keys_seeded(elems, N, gencount, s, time(NULL), 0);
+}
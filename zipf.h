@@ -35,7 +35,18 @@ long zipfian_gen (const ZIPFIAN);
 long zipfian_hash (const ZIPFIAN);
 // Effect: Return a random 64-bit number.  The numbers themselves are uniform hashes of the numbers from 0 (inclusive) to N (exclusive)
 
+double zipf_harmonic (long N, double s);
+// Effect: return H_{N,s} in O(1): the first terms exactly, the rest of the sum by Euler-Maclaurin.
+
+void generate_random_keys_seeded (uint64_t *elems, long N, long gencount, double s,
+                                  uint64_t seed, int threads);
+// Effect: fill elems[0..gencount) with hashes of zipfian numbers from a universe of N, sampled by
+//   rejection-inversion (Hoermann and Derflinger), O(1) time and space per number and no table.
+//   Item i draws its randomness from a counter based stream keyed by (seed, i), so the output
+//   only depends on the seed, never on the number of threads filling it (0 = one per CPU).
+
 void generate_random_keys (uint64_t *elems, long N, long gencount, double s);
+// Effect: generate_random_keys_seeded with a time based seed and one thread per CPU.
 
 #ifdef __cplusplus
 }